@@ -0,0 +1,99 @@
+#include "LBoltBuilder.h"
+
+LBoltBuilder::LBoltBuilder()
+{
+	bHasSymbols = false;
+	bHasDag = false;
+	SymbolsSeed = 0;
+}
+
+LBoltBuilder::~LBoltBuilder()
+{
+}
+
+// Generates a new bolt from the request. Nothing outside of the builder is read or written, so the request is the only thing the game thread has to hand over.
+TSharedRef<const LBolt> LBoltBuilder::Build(const LBoltRequest& request)
+{
+	TSharedRef<LBolt> bolt = MakeShared<LBolt>();
+
+	SCOPE_CYCLE_COUNTER(STAT_BuildBolt)
+	{
+		double start = FPlatformTime::Seconds();
+
+		bolt->Seed = request.Seed;
+		bolt->bIsPhysics = request.bUsePhysicsModel;
+		bolt->PhysicsScale = request.PModel.Scale;
+		bolt->bIsTruncated = false;
+		bolt->Estimate = request.Estimate;
+
+		if (request.bUsePhysicsModel)
+		{
+			// The request's copy of the model is copied again, as generating changes its random numbers and segments.
+			PhysicsModel model = request.PModel;
+			model.SetSeed(request.Seed);
+			model.GenerateSegments();
+			bolt->PhysicsSegments = model.ReleaseSegments();
+		}
+		else
+		{
+			// The symbols of the last bolt are reused if only the interpretation has changed.
+			if (request.FirstStage <= LStage_Expansion || !bHasSymbols || SymbolsSeed != request.Seed)
+			{
+				bHasDag = request.bShareSubtrees && BuildDag(request);
+
+				if (!bHasDag)
+				{
+					System.SetBudget(request.MaxSymbols, request.MaxBytes);
+					System.SetPackSymbols(request.bPackSymbols);
+					System.Build(request.Rules, request.Iterations, request.Seed);
+				}
+
+				bHasSymbols = true;
+				SymbolsSeed = request.Seed;
+			}
+
+			Turtle.Begin(request.TurtleSettings, request.Seed);
+
+			if (bHasDag)
+			{
+				Turtle.Interpret(Dag, bolt->Segments);
+			}
+			else if (System.IsParametric())
+			{
+				Turtle.Interpret(System.GetModules(), bolt->Segments);
+			}
+			else if (System.IsPacked())
+			{
+				Turtle.Interpret(System.GetPackedSymbols(), bolt->Segments);
+			}
+			else
+			{
+				Turtle.Interpret(System.GetSymbols(), bolt->Segments);
+			}
+
+			bolt->Analysis = Turtle.GetAnalysis();
+			bolt->bIsTruncated = !bHasDag && System.IsTruncated();
+		}
+
+		double end = FPlatformTime::Seconds();
+		bolt->GenerationTime = end - start;
+	}
+
+	return bolt;
+}
+
+// The grammar is compiled without iterating, then expanded into the DAG. The DAG's own memory is small, but the string it draws still has to fit the segment buffer and the symbol limit.
+bool LBoltBuilder::BuildDag(const LBoltRequest& request)
+{
+	System.Prepare(request.Rules);
+
+	if (System.IsParametric() || System.GetGrammar().HasPatterns())
+	{
+		return false;
+	}
+
+	Dag.Build(System.GetGrammar(), request.Iterations, request.Seed, request.SubtreeVariants);
+
+	const int64 maxSymbols = request.MaxSymbols > 0 ? FMath::Min(request.MaxSymbols, (int64)MAX_int32) : (int64)MAX_int32;
+	return Dag.GetLength() <= maxSymbols;
+}
@@ -0,0 +1,109 @@
+// Lightning bolt generation off the game thread. A request is a copy of every property needed to generate a bolt, so it can be read on a worker thread while the properties are changed through the user interface.
+// Finished bolts are never changed once they are published, so the game thread can draw one while the next is generated.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "LSystem.h"
+#include "LDerivationDag.h"
+#include "LTurtle.h"
+#include "PhysicsModel.h"
+#include "LCostEstimator.h"
+
+DECLARE_CYCLE_STAT(TEXT("Build Bolt"), STAT_BuildBolt, STATGROUP_LSystem);
+
+// The stages of generating L-system lightning, in the order they run. Each stage only uses the results of the stages before it, so changing a parameter only needs its own stage and the ones after it to run again.
+enum ELStage : uint8
+{
+	LStage_Grammar = 0, // Building and compiling the rules.
+	LStage_Expansion, // Rewriting the axiom into the final symbols.
+	LStage_Interpretation, // Turning the symbols into segments.
+	LStage_Render, // Spawning particles for the segments.
+	LStage_Count
+};
+
+// A snapshot of the properties used to generate a bolt.
+struct LBoltRequest
+{
+	// The first stage to run. Later stages reuse the results of the last bolt with the same seed.
+	ELStage FirstStage;
+
+	int32 Seed;
+	bool bUsePhysicsModel;
+
+	// A copy of the physics model, with the properties it had when the bolt was requested.
+	PhysicsModel PModel;
+
+	// L-system properties.
+	LGrammarBuilder Rules;
+	int32 Iterations;
+	int64 MaxSymbols;
+	int64 MaxBytes;
+	bool bPackSymbols;
+
+	// Whether to expand into a shared derivation, and the number of seed classes each symbol can be in.
+	bool bShareSubtrees;
+	int32 SubtreeVariants;
+
+	LTurtleSettings TurtleSettings;
+
+	// The estimated cost of these properties, which the bolt's time is compared against. This has no segments if it shouldn't be compared.
+	LCostEstimate Estimate;
+};
+
+// A finished bolt, from either model.
+struct LBolt
+{
+	int32 Seed;
+	bool bIsPhysics;
+
+	// Segments drawn by the turtle, for L-system bolts, and what the turtle found in their symbols.
+	LSegmentBuffer Segments;
+	LSymbolAnalysis Analysis;
+
+	// Segments generated by the physics model, and the scale of their diameters.
+	TArray<Segment> PhysicsSegments;
+	float PhysicsScale;
+
+	// Whether the L system stopped early because it reached its budget.
+	bool bIsTruncated;
+
+	// Time taken to generate the bolt, in seconds, and the estimate made for its request.
+	double GenerationTime;
+	LCostEstimate Estimate;
+
+	int32 Num() const { return bIsPhysics ? PhysicsSegments.Num() : Segments.Num(); };
+};
+
+/**
+ * 
+ */
+class PROCEDURALLIGHTNING_API LBoltBuilder
+{
+public:
+	// Constructor and destructor.
+	LBoltBuilder();
+	~LBoltBuilder();
+
+	// Generates a bolt. This can run on any thread, but only one bolt can be built at a time, as the L system and turtle are kept between bolts.
+	TSharedRef<const LBolt> Build(const LBoltRequest& request);
+
+	// Sets the directory that compiled grammars are cached in. This must not be called while a bolt is being built.
+	void SetCacheDirectory(const FString& directory) { System.SetCacheDirectory(directory); };
+
+private:
+	// Expands the request's rules into the shared derivation. Returns false if the grammar has parameters or patterns, or the string would be over the symbol limit, in which case the L system is built instead.
+	bool BuildDag(const LBoltRequest& request);
+
+	// The L system is kept so its buffers don't need to be reallocated, and so its symbols can be interpreted again.
+	LSystem System;
+	LTurtle Turtle;
+
+	// The shared derivation, used in place of the L system's symbols when the request asks for it and the grammar can be expanded one symbol at a time.
+	LDerivationDag Dag;
+	bool bHasDag;
+
+	// Whether the L system holds the symbols built with this seed.
+	bool bHasSymbols;
+	int32 SymbolsSeed;
+};
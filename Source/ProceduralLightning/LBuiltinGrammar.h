@@ -0,0 +1,52 @@
+// The lightning generator's own rules. Every rule replaces F with one of six productions, and only their probabilities change, so the productions are known at compile time.
+// A grammar compiled from these rules is rewritten with the productions written out here rather than looked up in its tables. Any other rules use the grammar's tables as normal.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "LGrammar.h"
+
+namespace LBuiltinGrammar
+{
+	// The productions of F, in the order the lightning generator adds their rules: F, F[+F], F[-F], FF, F+F and F-F.
+	constexpr int32 NumProductions = 6;
+	constexpr int32 MaxLength = 5;
+
+	constexpr uint8 Successors[NumProductions][MaxLength] =
+	{
+		{ LSymbol_Forward },
+		{ LSymbol_Forward, LSymbol_Save, LSymbol_RotateRight, LSymbol_Forward, LSymbol_Return },
+		{ LSymbol_Forward, LSymbol_Save, LSymbol_RotateLeft, LSymbol_Forward, LSymbol_Return },
+		{ LSymbol_Forward, LSymbol_Forward },
+		{ LSymbol_Forward, LSymbol_RotateRight, LSymbol_Forward },
+		{ LSymbol_Forward, LSymbol_RotateLeft, LSymbol_Forward },
+	};
+
+	constexpr int32 Lengths[NumProductions] = { 1, 5, 5, 2, 3, 3 };
+
+	// Writes a production's symbols and returns the number written. Each case is a few constant stores.
+	FORCEINLINE int32 Write(int32 production, uint8* output)
+	{
+		switch (production)
+		{
+		case 0:
+			output[0] = LSymbol_Forward;
+			return 1;
+		case 1:
+			output[0] = LSymbol_Forward; output[1] = LSymbol_Save; output[2] = LSymbol_RotateRight; output[3] = LSymbol_Forward; output[4] = LSymbol_Return;
+			return 5;
+		case 2:
+			output[0] = LSymbol_Forward; output[1] = LSymbol_Save; output[2] = LSymbol_RotateLeft; output[3] = LSymbol_Forward; output[4] = LSymbol_Return;
+			return 5;
+		case 3:
+			output[0] = LSymbol_Forward; output[1] = LSymbol_Forward;
+			return 2;
+		case 4:
+			output[0] = LSymbol_Forward; output[1] = LSymbol_RotateRight; output[2] = LSymbol_Forward;
+			return 3;
+		default:
+			output[0] = LSymbol_Forward; output[1] = LSymbol_RotateLeft; output[2] = LSymbol_Forward;
+			return 3;
+		}
+	}
+}
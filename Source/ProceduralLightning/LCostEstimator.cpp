@@ -0,0 +1,268 @@
+#include "LCostEstimator.h"
+
+LCostEstimator::LCostEstimator()
+{
+	NanosecondsPerSymbol = 5.0;
+	NanosecondsPerPhysicsSegment = 1000.0;
+}
+
+LCostEstimator::~LCostEstimator()
+{
+}
+
+// Builds the mean matrix, where row a holds the expected number of each symbol that a is rewritten into. Symbols without rules are rewritten into themselves.
+static void BuildMeanMatrix(const LGrammar& grammar, TArray<double>& matrix)
+{
+	const int32 n = grammar.GetAlphabet().Num();
+	matrix.SetNumZeroed(n * n);
+
+	for (int32 a = 0; a < n; a++)
+	{
+		const LProductionGroup& group = grammar.GetGroups()[a];
+
+		if (group.Num == 0)
+		{
+			matrix[a * n + a] = 1.0;
+			continue;
+		}
+
+		for (int32 p = group.First; p < group.First + group.Num; p++)
+		{
+			const LProduction& production = grammar.GetProductions()[p];
+
+			for (int32 k = production.Offset; k < production.Offset + production.Length; k++)
+			{
+				matrix[a * n + grammar.GetSuccessors()[k]] += production.Probability;
+			}
+		}
+	}
+}
+
+// Each iteration multiplies the counts by the mean matrix. This gives the exact expected counts, including the iterations before the string settles into its growth rate.
+void LCostEstimator::ExpectSymbols(const LGrammar& grammar, const TArray<double>& matrix, int iterations, TArray<TArray<double>>& counts)
+{
+	const int32 n = grammar.GetAlphabet().Num();
+
+	counts.SetNum(iterations + 1);
+	counts[0].SetNumZeroed(n);
+
+	for (uint8 symbol : grammar.GetAxiom())
+	{
+		counts[0][symbol] += 1.0;
+	}
+
+	for (int32 i = 0; i < iterations; i++)
+	{
+		counts[i + 1].SetNumZeroed(n);
+
+		for (int32 a = 0; a < n; a++)
+		{
+			for (int32 b = 0; b < n; b++)
+			{
+				counts[i + 1][b] += counts[i][a] * matrix[a * n + b];
+			}
+		}
+	}
+}
+
+// The mean matrix has no negative entries, so repeatedly multiplying any positive vector by it converges on its largest eigenvalue.
+double LCostEstimator::GetGrowthRate(const TArray<double>& matrix, int32 numSymbols)
+{
+	TArray<double> vector;
+	TArray<double> next;
+	vector.Init(1.0 / FMath::Max(numSymbols, 1), numSymbols);
+
+	double rate = 0.0;
+
+	for (int32 i = 0; i < 64; i++)
+	{
+		next.Init(0.0, numSymbols);
+
+		for (int32 a = 0; a < numSymbols; a++)
+		{
+			for (int32 b = 0; b < numSymbols; b++)
+			{
+				next[b] += vector[a] * matrix[a * numSymbols + b];
+			}
+		}
+
+		double total = 0.0;
+		for (double value : next)
+		{
+			total += value;
+		}
+
+		if (total <= 0.0)
+		{
+			return 0.0;
+		}
+
+		rate = total;
+		for (int32 b = 0; b < numSymbols; b++)
+		{
+			vector[b] = next[b] / total;
+		}
+	}
+
+	return rate;
+}
+
+// Peak memory is the larger of the last iteration, which holds its input, a choice for each input symbol and its output, and the interpretation, which holds the string, a bracket entry for each symbol and the segments.
+LCostEstimate LCostEstimator::EstimateLSystem(const LGrammar& grammar, int iterations, int64 maxSymbols, bool bPackSymbols) const
+{
+	LCostEstimate estimate;
+	const int32 n = grammar.GetAlphabet().Num();
+
+	if (n == 0)
+	{
+		return estimate;
+	}
+
+	TArray<double> matrix;
+	BuildMeanMatrix(grammar, matrix);
+
+	TArray<TArray<double>> counts;
+	ExpectSymbols(grammar, matrix, iterations, counts);
+
+	TArray<double> totals;
+	for (const TArray<double>& iteration : counts)
+	{
+		double total = 0.0;
+		for (double count : iteration)
+		{
+			total += count;
+		}
+
+		totals.Add(total);
+	}
+
+	double rewritten = 0.0;
+	double previous = 0.0;
+	double symbols = totals[0];
+
+	for (int32 i = 1; i <= iterations; i++)
+	{
+		rewritten += totals[i - 1];
+		previous = totals[i - 1];
+		symbols = totals[i];
+
+		// The grammar stops once the limit is reached, so nothing after it is rewritten.
+		if (maxSymbols > 0 && symbols > maxSymbols)
+		{
+			estimate.bIsTruncated = true;
+			symbols = (double)maxSymbols;
+			break;
+		}
+	}
+
+	// Segments are the same fraction of the string however much of it is built.
+	estimate.Symbols = symbols;
+	estimate.Segments = totals[iterations] > 0.0 ? symbols * counts[iterations][LSymbol_Forward] / totals[iterations] : 0.0;
+
+	const double symbolBytes = bPackSymbols && n <= LPackedSymbols::MaxAlphabetSize ? LPackedSymbols::BitsPerSymbol / 8.0 : 1.0;
+	const double segmentBytes = 3 * sizeof(FVector) + sizeof(float) + sizeof(uint8);
+	const double expansionBytes = previous * 2 + symbols * symbolBytes;
+	const double interpretationBytes = symbols * (symbolBytes + sizeof(int32)) + estimate.Segments * segmentBytes;
+
+	estimate.MemoryBytes = FMath::Max(expansionBytes, interpretationBytes);
+	estimate.Work = rewritten + symbols;
+	estimate.Milliseconds = estimate.Work * NanosecondsPerSymbol / 1000000.0;
+	estimate.GrowthRate = GetGrowthRate(matrix, n);
+
+	return estimate;
+}
+
+// Each segment's diameter is sqrt(1/2) times its parent's, relative to their minimum diameters, so the ratio of diameter to minimum diameter falls by sqrt(2) each generation whatever the pressure and temperature.
+// A segment can only continue or branch while its ratio is above 1. So the number of generations follows from the first segment's ratio, and each generation has 1 + BranchChance times as many segments as the last.
+LCostEstimate LCostEstimator::EstimatePhysics(const PhysicsModel& model) const
+{
+	LCostEstimate estimate;
+	estimate.bIsPhysics = true;
+
+	// The first segment's diameter and minimum diameter, at the start height.
+	const double pressure = model.CalculatePressure(model.StartHeight) * model.PressureMultiplier;
+	const double temperature = model.SeaLevelTemp - (model.StartHeight / 1000.0 * 6.5);
+	const double minDiameter = FMath::Max((double)model.ConstantA, 0.01) * (temperature / 293.0) / pressure;
+	const double ratio = model.Voltage * model.ConstantnV / minDiameter;
+
+	// The first generation after the first segment that can't continue.
+	const int32 generations = ratio > 1.0 ? FMath::Max(1, FMath::CeilToInt(2.0 * FMath::Log2(ratio))) : 1;
+	const double growth = 1.0 + model.BranchChance;
+
+	// The first segment always continues into the second, then each generation up to the last grows by the branch chance.
+	double segments = 1.0;
+	double generation = 1.0;
+	for (int32 k = 1; k <= generations; k++)
+	{
+		segments += generation;
+		generation *= growth;
+	}
+
+	// The packaged build fix adds the second segment as a branch point twice when it branches, so its branch is made twice.
+	if (model.bPackagedBuildFix && generations >= 2)
+	{
+		double extra = 0.0;
+		generation = 1.0;
+		for (int32 k = 2; k <= generations; k++)
+		{
+			extra += generation;
+			generation *= growth;
+		}
+
+		segments += model.BranchChance * extra;
+	}
+
+	if (model.bUseSegmentLimit)
+	{
+		segments = FMath::Min(segments, (double)model.MaxSegments);
+	}
+
+	// Segments are copied from their branch into the model's array, so each is held twice at most.
+	estimate.Segments = segments;
+	estimate.MemoryBytes = segments * sizeof(Segment) * 2;
+	estimate.Work = segments;
+	estimate.Milliseconds = segments * NanosecondsPerPhysicsSegment / 1000000.0;
+	estimate.GrowthRate = growth;
+
+	return estimate;
+}
+
+// The cost only grows with more iterations, so the search stops at the first one that doesn't fit.
+int32 LCostEstimator::FitIterations(const LGrammar& grammar, int maxIterations, int64 maxSymbols, bool bPackSymbols, double budgetMilliseconds, double budgetBytes) const
+{
+	int32 best = 1;
+
+	for (int32 its = 1; its <= maxIterations; its++)
+	{
+		const LCostEstimate estimate = EstimateLSystem(grammar, its, maxSymbols, bPackSymbols);
+
+		if ((budgetMilliseconds > 0.0 && estimate.Milliseconds > budgetMilliseconds) || (budgetBytes > 0.0 && estimate.MemoryBytes > budgetBytes))
+		{
+			break;
+		}
+
+		best = its;
+	}
+
+	return best;
+}
+
+int32 LCostEstimator::FitPhysicsSegments(double budgetMilliseconds) const
+{
+	return FMath::Max(1, (int32)FMath::Min(budgetMilliseconds * 1000000.0 / NanosecondsPerPhysicsSegment, (double)MAX_int32));
+}
+
+// The time per unit moves part of the way towards the time observed, so one slow strike doesn't throw off the estimate.
+void LCostEstimator::Observe(const LCostEstimate& estimate, int32 segments, double seconds)
+{
+	if (estimate.Segments <= 0.0 || segments <= 0 || seconds <= 0.0)
+	{
+		return;
+	}
+
+	const double work = estimate.Work * segments / estimate.Segments;
+	const double nanoseconds = seconds * 1000000000.0 / work;
+
+	double& cost = estimate.bIsPhysics ? NanosecondsPerPhysicsSegment : NanosecondsPerSymbol;
+	cost = FMath::Lerp(cost, nanoseconds, ObserveRate);
+}
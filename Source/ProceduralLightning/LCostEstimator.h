@@ -0,0 +1,71 @@
+// Predicts the cost of a strike before it is generated, for both models, so the number of iterations or segments can be chosen to fit a budget.
+// The L system's expected growth comes from its mean matrix - the expected number of each symbol that each symbol is rewritten into. The physics model's comes from how quickly a branch's diameter falls to its minimum diameter.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "LGrammar.h"
+#include "PhysicsModel.h"
+
+// The expected cost of a strike.
+struct LCostEstimate
+{
+	bool bIsPhysics = false;
+
+	// Expected number of segments, and of symbols in the final string for the L system.
+	double Segments = 0.0;
+	double Symbols = 0.0;
+
+	// Expected peak memory and generation time.
+	double MemoryBytes = 0.0;
+	double Milliseconds = 0.0;
+
+	// Symbols rewritten and interpreted, or physics segments generated. Time is this multiplied by the cost of each.
+	double Work = 0.0;
+
+	// The factor the string grows by each iteration once it is long, which is the largest eigenvalue of the mean matrix.
+	double GrowthRate = 0.0;
+
+	// Whether the L system is expected to reach its symbol limit.
+	bool bIsTruncated = false;
+};
+
+/**
+ * 
+ */
+class PROCEDURALLIGHTNING_API LCostEstimator
+{
+public:
+	// Constructor and destructor.
+	LCostEstimator();
+	~LCostEstimator();
+
+	// The expected cost of iterating a compiled grammar. Rules with patterns are left out, as how often they match depends on the symbols around them.
+	LCostEstimate EstimateLSystem(const LGrammar& grammar, int iterations, int64 maxSymbols, bool bPackSymbols) const;
+
+	// The expected cost of generating with the physics model's current properties.
+	LCostEstimate EstimatePhysics(const PhysicsModel& model) const;
+
+	// Returns the most iterations, up to maxIterations, that are expected to fit in the time and memory budgets. At least 1 iteration is always returned. A budget of 0 has no limit.
+	int32 FitIterations(const LGrammar& grammar, int maxIterations, int64 maxSymbols, bool bPackSymbols, double budgetMilliseconds, double budgetBytes) const;
+
+	// Returns the most physics segments expected to fit in the time budget.
+	int32 FitPhysicsSegments(double budgetMilliseconds) const;
+
+	// Adjusts the cost of each unit of work from a strike that was generated. The estimate is scaled by the number of segments actually made, so only the time per unit is learned.
+	void Observe(const LCostEstimate& estimate, int32 segments, double seconds);
+
+private:
+	// Expected counts of each symbol after each iteration, from the axiom's counts and the mean matrix. Counts[i] is the counts after i iterations.
+	static void ExpectSymbols(const LGrammar& grammar, const TArray<double>& matrix, int iterations, TArray<TArray<double>>& counts);
+
+	// Largest eigenvalue of the mean matrix, by power iteration.
+	static double GetGrowthRate(const TArray<double>& matrix, int32 numSymbols);
+
+	// Time taken by each unit of work, learned from generated strikes. These start from typical values.
+	double NanosecondsPerSymbol;
+	double NanosecondsPerPhysicsSegment;
+
+	// How much of each observation is taken into the learned costs.
+	static constexpr double ObserveRate = 0.2;
+};
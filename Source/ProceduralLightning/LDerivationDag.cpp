@@ -0,0 +1,128 @@
+#include "LDerivationDag.h"
+#include "LRandom.h"
+
+LDerivationDag::LDerivationDag()
+{
+	Grammar = nullptr;
+	Seed = 0;
+	NumSeedClasses = 1;
+	Root = 0;
+}
+
+LDerivationDag::~LDerivationDag()
+{
+}
+
+// The root isn't shared, so it is added like any other node but not memoized. Each axiom symbol gets its seed class from its position.
+void LDerivationDag::Build(const LGrammar& grammar, int iterations, int32 seed, int32 numSeedClasses)
+{
+	SCOPE_CYCLE_COUNTER(STAT_BuildDag)
+	{
+		Grammar = &grammar;
+		Seed = seed;
+		NumSeedClasses = (uint32)FMath::Max(numSeedClasses, 1);
+
+		Nodes.Reset();
+		Children.Reset();
+		NodeIndices.Reset();
+
+		const TArray<uint8>& axiom = Grammar->GetAxiom();
+
+		TArray<int32> rootChildren;
+		rootChildren.Reserve(axiom.Num());
+
+		for (int32 i = 0; i < axiom.Num(); i++)
+		{
+			const uint32 seedClass = (uint32)(LRandom::Hash(Seed, LRandomStream_Derivation, i) % NumSeedClasses);
+			rootChildren.Add(AddNode(axiom[i], iterations, seedClass));
+		}
+
+		LDagNode root = { Children.Num(), rootChildren.Num(), 0, 0, 0 };
+		for (int32 child : rootChildren)
+		{
+			root.Length += Nodes[child].Length;
+			root.NumSegments += Nodes[child].NumSegments;
+		}
+
+		Children.Append(rootChildren);
+		Root = Nodes.Add(root);
+
+		Grammar = nullptr;
+	}
+}
+
+// A node's children are expanded before it is added, so its length is known. The recursion is only as deep as the number of iterations.
+int32 LDerivationDag::AddNode(uint8 symbol, int32 depth, uint32 seedClass)
+{
+	const LProductionGroup& group = Grammar->GetGroups()[symbol];
+
+	// Symbols at the final depth are final. Symbols without rules never change, so they are final at any depth.
+	if (depth == 0 || group.Num == 0)
+	{
+		return AddLeaf(symbol);
+	}
+
+	const uint64 key = ((uint64)seedClass << 32) | ((uint64)depth << 8) | symbol;
+	if (const int32* found = NodeIndices.Find(key))
+	{
+		return *found;
+	}
+
+	// The node's hash selects its production, and is the seed of its children's classes.
+	const uint64 hash = LRandom::Hash(Seed, LRandomStream_Derivation, key);
+	const LProduction& production = Grammar->GetProductions()[Grammar->SelectProduction(group, (hash >> 40) * (1.0f / 16777216.0f))];
+	const uint8* successors = Grammar->GetSuccessors().GetData() + production.Offset;
+
+	TArray<int32, TInlineAllocator<16>> children;
+	for (int32 i = 0; i < production.Length; i++)
+	{
+		const uint32 childClass = (uint32)(LRandom::Hash(hash, LRandomStream_Derivation, i) % NumSeedClasses);
+		children.Add(AddNode(successors[i], depth - 1, childClass));
+	}
+
+	LDagNode node = { Children.Num(), children.Num(), 0, 0, 0 };
+	for (int32 child : children)
+	{
+		node.Length += Nodes[child].Length;
+		node.NumSegments += Nodes[child].NumSegments;
+	}
+
+	Children.Append(children);
+
+	const int32 index = Nodes.Add(node);
+	NodeIndices.Add(key, index);
+	return index;
+}
+
+// Leaves are memoized by their symbol alone.
+int32 LDerivationDag::AddLeaf(uint8 symbol)
+{
+	const uint64 key = symbol;
+	if (const int32* found = NodeIndices.Find(key))
+	{
+		return *found;
+	}
+
+	const int32 index = Nodes.Add({ INDEX_NONE, 0, 1, symbol == LSymbol_Forward ? 1 : 0, symbol });
+	NodeIndices.Add(key, index);
+	return index;
+}
+
+// The string is written in one pass into an array of exactly its length.
+bool LDerivationDag::Flatten(TArray<uint8>& symbols) const
+{
+	if (GetLength() > MAX_int32)
+	{
+		return false;
+	}
+
+	symbols.Reset();
+	symbols.Reserve((int32)GetLength());
+
+	ForEachSymbol([&symbols](uint8 symbol)
+	{
+		symbols.Add(symbol);
+	});
+
+	return true;
+}
@@ -0,0 +1,113 @@
+// Shared derivation of an L system. Rather than building the whole string, each symbol is expanded once for every remaining depth and seed class, and every place it appears with those points at the same node.
+// A node's production and the seed classes of its children come from a hash of the node, so two nodes with the same symbol, depth and class always expand to the same symbols. Memory and time grow with the number of different nodes rather than the length of the string.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "LGrammar.h"
+
+DECLARE_CYCLE_STAT(TEXT("Build DAG"), STAT_BuildDag, STATGROUP_LSystem);
+
+// A symbol at a depth, expanded. Leaves are final symbols, and other nodes are a list of the nodes their production expands to.
+struct LDagNode
+{
+	// The node's children in the DAG's list of children, or -1 for a leaf.
+	int32 FirstChild;
+	int32 NumChildren;
+
+	// The number of final symbols and segments the node expands to.
+	int64 Length;
+	int64 NumSegments;
+
+	// The symbol of a leaf.
+	uint8 Symbol;
+
+	bool IsLeaf() const { return FirstChild == INDEX_NONE; };
+};
+
+/**
+ * 
+ */
+class PROCEDURALLIGHTNING_API LDerivationDag
+{
+public:
+	// Constructor and destructor.
+	LDerivationDag();
+	~LDerivationDag();
+
+	// Expands the grammar's axiom for the specified number of iterations. Each symbol that is rewritten can be in one of a number of seed classes, so more classes give more variety and less sharing.
+	// Only rules for single symbols are used, as patterns need the symbols around them. Grammars with patterns should be built instead.
+	void Build(const LGrammar& grammar, int iterations, int32 seed, int32 numSeedClasses);
+
+	// The number of final symbols and segments in the whole string.
+	int64 GetLength() const { return Nodes.IsEmpty() ? 0 : Nodes[Root].Length; };
+	int64 GetNumSegments() const { return Nodes.IsEmpty() ? 0 : Nodes[Root].NumSegments; };
+
+	// The number of different nodes, which is how much was expanded.
+	int32 NumNodes() const { return Nodes.Num(); };
+
+	// Calls a function on each final symbol in order, walking down the shared nodes. Only the path to the current symbol is stored.
+	template <typename FunctionType>
+	void ForEachSymbol(FunctionType&& function) const
+	{
+		if (Nodes.IsEmpty())
+		{
+			return;
+		}
+
+		// Each open node and the next of its children to visit.
+		TArray<TPair<int32, int32>, TInlineAllocator<32>> stack;
+		stack.Add(TPair<int32, int32>(Root, 0));
+
+		while (!stack.IsEmpty())
+		{
+			TPair<int32, int32>& top = stack.Last();
+			const LDagNode& node = Nodes[top.Key];
+
+			if (top.Value == node.NumChildren)
+			{
+				stack.Pop(false);
+				continue;
+			}
+
+			const int32 child = Children[node.FirstChild + top.Value++];
+
+			if (Nodes[child].IsLeaf())
+			{
+				function(Nodes[child].Symbol);
+			}
+			else
+			{
+				stack.Add(TPair<int32, int32>(child, 0));
+			}
+		}
+	};
+
+	// Writes out the whole string. Returns false without writing anything if it is too long for an array.
+	bool Flatten(TArray<uint8>& symbols) const;
+
+	// Bytes used by the nodes and their lists of children.
+	SIZE_T GetAllocatedSize() const { return Nodes.GetAllocatedSize() + Children.GetAllocatedSize() + NodeIndices.GetAllocatedSize(); };
+
+private:
+	// Returns the node for a symbol at a number of remaining iterations in a seed class, expanding it if it hasn't been yet.
+	int32 AddNode(uint8 symbol, int32 depth, uint32 seedClass);
+
+	// Returns the node for a final symbol.
+	int32 AddLeaf(uint8 symbol);
+
+	// The grammar being expanded, only while building.
+	const LGrammar* Grammar;
+
+	int32 Seed;
+	uint32 NumSeedClasses;
+
+	TArray<LDagNode> Nodes;
+	TArray<int32> Children;
+
+	// The node of each symbol, depth and seed class that has been expanded.
+	TMap<uint64, int32> NodeIndices;
+
+	// The node holding the axiom's symbols.
+	int32 Root;
+};
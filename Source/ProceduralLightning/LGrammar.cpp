@@ -1,118 +1,1902 @@
 #include "LGrammar.h"
+#include "LBuiltinGrammar.h"
+#include "LRandom.h"
+#include "Async/ParallelFor.h"
+#include "Async/TaskGraphInterfaces.h"
+#include "Async/MappedFileHandle.h"
+#include "HAL/FileManager.h"
+#include "HAL/PlatformFileManager.h"
+#include "Hash/CityHash.h"
+#include "Misc/FileHelper.h"
+#include "Misc/Paths.h"
+
+LGrammar::LGrammar()
+{
+}
 
 // The constructor. Here the axiom and rules are set.
 LGrammar::LGrammar(FString axiom, TArray<FString> rules)
 {
-	// Set starting string.
-	Condition = axiom;
+	SetRules(axiom, rules);
+}
+
+LGrammar::~LGrammar()
+{
+}
+
+LGrammar::LGrammar(const LGrammarBuilder& rules)
+{
+	SetRules(rules);
+}
+
+// Parses the rule strings into a builder. Strings that aren't rules are skipped.
+void LGrammar::SetRules(const FString& axiom, const TArray<FString>& rules)
+{
+	LGrammarBuilder builder;
+	builder.SetAxiom(axiom);
+
+	for (const FString& rule : rules)
+	{
+		builder.AddRuleString(rule);
+	}
+
+	SetRules(builder);
+}
+
+// Compiles the builder's rules along with its axiom.
+void LGrammar::SetRules(const LGrammarBuilder& rules)
+{
+	SymbolsRewritten = 0;
+
+	// If these rules are already compiled, or were compiled before and saved to the cache, there is nothing to compile.
+	const uint64 hash = rules.GetHash();
+
+	if ((bHasCompiled && hash == CompiledHash) || LoadCompiled(GetCacheFile(hash), hash))
+	{
+		CompiledHash = hash;
+		bHasCompiled = true;
+		DetectBuiltin();
+		ResetSymbols();
+		return;
+	}
+
+	// The builder has already checked each rule, so they are copied as they are.
+	RulesArray.Reset();
+
+	for (int32 r = 0; r < rules.Num(); r++)
+	{
+		RulesArray.Emplace(FString(rules.GetPredecessor(r)), FString(rules.GetSuccessor(r)), rules.GetWeight(r));
+	}
+
+	// Build the production table and set the starting symbols.
+	Compile(FString(rules.GetAxiom()));
+	DetectBuiltin();
+
+	CompiledHash = hash;
+	bHasCompiled = true;
+
+	// Save the compiled grammar so it doesn't need to be compiled next time.
+	const FString cacheFile = GetCacheFile(hash);
+	if (!cacheFile.IsEmpty())
+	{
+		SaveCompiled(cacheFile);
+	}
+}
+
+// Sets the symbols and modules back to the axiom. The buffers keep their memory.
+void LGrammar::ResetSymbols()
+{
+	Symbols.Reset();
+	Symbols.Append(Axiom);
+	Modules.Reset();
+	Modules.Append(AxiomModules);
+	bIsPacked = false;
+}
+
+// Identifies a cache file, and the version of its layout. The version must change whenever a compiled table changes.
+static constexpr uint32 CacheMagic = 0x4D52474C; // "LGRM"
+static constexpr uint32 CacheVersion = 1;
+static constexpr int32 CacheTableCount = 13;
+
+// The start of a cache file. The tables follow, each starting on an 8 byte boundary.
+struct LCacheHeader
+{
+	uint32 Magic;
+	uint32 Version;
+	uint64 Hash;
+	uint32 CharSize;
+	uint32 bIsParametric;
+	int32 TableNums[CacheTableCount];
+};
+
+// Rounds a position in a cache file up to the start of the next table.
+static int64 AlignCachePosition(int64 position)
+{
+	return Align(position, 8);
+}
+
+// Calls a function on each compiled table, in the order they are stored in the cache.
+template <typename FunctionType>
+void LGrammar::ForEachTable(FunctionType&& function)
+{
+	function(Alphabet);
+	function(Axiom);
+	function(Groups);
+	function(Productions);
+	function(Successors);
+	function(SuccessorParams);
+	function(SuccessorDepths);
+	function(AxiomModules);
+	function(Patterns);
+	function(Transitions);
+	function(OutputOffsets);
+	function(Outputs);
+	function(DictionaryLinks);
+}
+
+// Returns the cache file for a hash.
+FString LGrammar::GetCacheFile(uint64 hash) const
+{
+	if (CacheDirectory.IsEmpty())
+	{
+		return FString();
+	}
+
+	return FPaths::Combine(CacheDirectory, FString::Printf(TEXT("%016llx.lgc"), hash));
+}
+
+// Saves the header followed by each table's memory, as it is stored in the grammar.
+// Grammars on other threads can save or load the same file, so it is written to a file of its own first then moved into place. A grammar loading it sees either the old file or the whole of the new one.
+bool LGrammar::SaveCompiled(const FString& path)
+{
+	LCacheHeader header;
+	FMemory::Memzero(header);
+	header.Magic = CacheMagic;
+	header.Version = CacheVersion;
+	header.Hash = CompiledHash;
+	header.CharSize = sizeof(TCHAR);
+	header.bIsParametric = bIsParametric ? 1 : 0;
+
+	int32 table = 0;
+	ForEachTable([&header, &table](auto& elements)
+	{
+		header.TableNums[table++] = elements.Num();
+	});
+
+	TArray<uint8> buffer;
+	buffer.Append((const uint8*)&header, sizeof(header));
+
+	ForEachTable([&buffer](auto& elements)
+	{
+		buffer.SetNumZeroed((int32)AlignCachePosition(buffer.Num()));
+		buffer.Append((const uint8*)elements.GetData(), elements.Num() * elements.GetTypeSize());
+	});
+
+	const FString tempPath = FString::Printf(TEXT("%s.%s.tmp"), *path, *FGuid::NewGuid().ToString());
+
+	if (!FFileHelper::SaveArrayToFile(buffer, *tempPath) || !IFileManager::Get().Move(*path, *tempPath, true, true))
+	{
+		IFileManager::Get().Delete(*tempPath, false, false, true);
+		UE_LOG(LogTemp, Warning, TEXT("LGrammar: couldn't save compiled grammar to '%s'."), *path);
+		return false;
+	}
+
+	return true;
+}
+
+// Loads a compiled grammar by mapping the file into memory and copying each table straight out of it.
+bool LGrammar::LoadCompiled(const FString& path, uint64 hash)
+{
+	if (path.IsEmpty())
+	{
+		return false;
+	}
+
+	TUniquePtr<IMappedFileHandle> file(FPlatformFileManager::Get().GetPlatformFile().OpenMapped(*path));
+	if (!file.IsValid() || file->GetFileSize() < (int64)sizeof(LCacheHeader))
+	{
+		return false;
+	}
+
+	TUniquePtr<IMappedFileRegion> region(file->MapRegion(0, file->GetFileSize()));
+	if (!region.IsValid())
+	{
+		return false;
+	}
+
+	const uint8* data = region->GetMappedPtr();
+	const int64 size = region->GetMappedSize();
+
+	// Files from another version, platform or set of rules can't be used.
+	LCacheHeader header;
+	FMemory::Memcpy(&header, data, sizeof(header));
+
+	if (header.Magic != CacheMagic || header.Version != CacheVersion || header.Hash != hash || header.CharSize != sizeof(TCHAR))
+	{
+		return false;
+	}
+
+	// Check that every table fits in the file before copying any of them, so a broken file leaves the grammar as it was.
+	int64 position = sizeof(header);
+	int32 table = 0;
+	bool bIsValid = true;
+
+	ForEachTable([&](auto& elements)
+	{
+		const int32 num = header.TableNums[table++];
+		position = AlignCachePosition(position);
+		bIsValid &= num >= 0 && position + (int64)num * elements.GetTypeSize() <= size;
+		position += (int64)FMath::Max(num, 0) * elements.GetTypeSize();
+	});
+
+	if (!bIsValid)
+	{
+		UE_LOG(LogTemp, Warning, TEXT("LGrammar: compiled grammar '%s' is broken, compiling the rules instead."), *path);
+		return false;
+	}
+
+	position = sizeof(header);
+	table = 0;
+
+	ForEachTable([&](auto& elements)
+	{
+		const int32 num = header.TableNums[table++];
+		position = AlignCachePosition(position);
+		elements.SetNumUninitialized(num);
+		FMemory::Memcpy(elements.GetData(), data + position, (int64)num * elements.GetTypeSize());
+		position += (int64)num * elements.GetTypeSize();
+	});
+
+	bIsParametric = header.bIsParametric != 0;
+	RulesArray.Reset();
+
+	// A file with a valid header can still be stale or damaged. Its tables are thrown away, and the rules are compiled over them.
+	if (!IsCompiledValid())
+	{
+		UE_LOG(LogTemp, Warning, TEXT("LGrammar: compiled grammar '%s' has indices outside of its tables, compiling the rules instead."), *path);
+		return false;
+	}
+
+	return true;
+}
+
+// Checks each table against the tables it indexes, in the order Compile builds them.
+bool LGrammar::IsCompiledValid() const
+{
+	const int32 alphabetSize = Alphabet.Num();
+
+	// The lightning symbols always come first, and symbols are stored as uint8.
+	if (alphabetSize < LSymbol_Count || alphabetSize > MAX_uint8 + 1 || Groups.Num() < alphabetSize)
+	{
+		return false;
+	}
+
+	if (FMemory::Memcmp(Alphabet.GetData(), TEXT("F+-[]"), LSymbol_Count * sizeof(TCHAR)) != 0)
+	{
+		return false;
+	}
+
+	auto isSymbol = [alphabetSize](uint8 symbol)
+	{
+		return symbol < alphabetSize;
+	};
+
+	for (uint8 symbol : Axiom)
+	{
+		if (!isSymbol(symbol))
+		{
+			return false;
+		}
+	}
+
+	for (const LModule& module : AxiomModules)
+	{
+		if (!isSymbol(module.Symbol))
+		{
+			return false;
+		}
+	}
+
+	for (uint8 symbol : Successors)
+	{
+		if (!isSymbol(symbol))
+		{
+			return false;
+		}
+	}
+
+	// Parametric grammars read the axiom's modules and an expression and depth for each successor symbol.
+	if (bIsParametric && (AxiomModules.Num() != Axiom.Num() || SuccessorDepths.Num() != Successors.Num() || SuccessorParams.Num() != Successors.Num() * LParam_Count))
+	{
+		return false;
+	}
+
+	for (const LParamExpression& expression : SuccessorParams)
+	{
+		if (expression.Param < INDEX_NONE || expression.Param >= LParam_Count)
+		{
+			return false;
+		}
+	}
+
+	// Choices are stored as uint8, and an alias is an index within its own group.
+	for (const LProductionGroup& group : Groups)
+	{
+		if (group.First < 0 || group.Num < 0 || group.Num > KeepSymbol || group.First > Productions.Num() - group.Num)
+		{
+			return false;
+		}
+
+		for (int32 p = group.First; p < group.First + group.Num; p++)
+		{
+			const LProduction& production = Productions[p];
+
+			if (production.Offset < 0 || production.Length < 0 || production.Offset > Successors.Num() - production.Length || production.Alias < 0 || production.Alias >= group.Num)
+			{
+				return false;
+			}
+		}
+	}
+
+	// Pattern groups come after the groups of each symbol.
+	for (const LPattern& pattern : Patterns)
+	{
+		if (pattern.Group < alphabetSize || pattern.Group >= Groups.Num() || pattern.Length < 1 || pattern.LeftLength < 0 || pattern.RightLength < 0)
+		{
+			return false;
+		}
+	}
+
+	// The automaton always has a root, with a transition for every symbol from each state.
+	const int32 numStates = DictionaryLinks.Num();
+
+	if (numStates < 1 || Transitions.Num() != (int64)numStates * alphabetSize || OutputOffsets.Num() != numStates + 1)
+	{
+		return false;
+	}
+
+	for (int32 state : Transitions)
+	{
+		if (state < 0 || state >= numStates)
+		{
+			return false;
+		}
+	}
+
+	for (int32 state : DictionaryLinks)
+	{
+		if (state < INDEX_NONE || state >= numStates)
+		{
+			return false;
+		}
+	}
+
+	if (OutputOffsets[0] != 0 || OutputOffsets[numStates] != Outputs.Num())
+	{
+		return false;
+	}
+
+	for (int32 state = 0; state < numStates; state++)
+	{
+		if (OutputOffsets[state] > OutputOffsets[state + 1])
+		{
+			return false;
+		}
+	}
+
+	for (int32 pattern : Outputs)
+	{
+		if (pattern < 0 || pattern >= Patterns.Num())
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+// Returns the symbol for a char, adding it to the alphabet if it hasn't been seen yet.
+int32 LGrammar::AddSymbol(TCHAR c)
+{
+	int32 symbol = Alphabet.Find(c);
+
+	if (symbol == INDEX_NONE)
+	{
+		// Symbols are stored as uint8, so the alphabet can't grow past 256 chars.
+		if (Alphabet.Num() > MAX_uint8)
+		{
+			return INDEX_NONE;
+		}
+
+		symbol = Alphabet.Add(c);
+	}
+
+	return symbol;
+}
+
+// A symbol and the text of its parameters, as written in a rule or axiom.
+struct LParsedModule
+{
+	TCHAR Symbol;
+	TArray<FString> Arguments;
+};
+
+// Splits a string into modules. Parameters are written in brackets after a symbol and separated by commas, such as F(l,w*0.66).
+static void ParseModules(const FString& text, TArray<LParsedModule>& modules)
+{
+	modules.Reset();
+
+	int32 i = 0;
+	while (i < text.Len())
+	{
+		LParsedModule& module = modules.AddDefaulted_GetRef();
+		module.Symbol = text[i++];
+
+		if (i < text.Len() && text[i] == '(')
+		{
+			// Read up to the matching bracket, splitting on commas that aren't inside another bracket.
+			FString argument;
+			int32 depth = 1;
+			i++;
+
+			while (i < text.Len())
+			{
+				const TCHAR c = text[i++];
+
+				if (c == '(')
+				{
+					depth++;
+				}
+				else if (c == ')' && --depth == 0)
+				{
+					break;
+				}
+				else if (c == ',' && depth == 1)
+				{
+					module.Arguments.Add(argument.TrimStartAndEnd());
+					argument.Reset();
+					continue;
+				}
+
+				argument.AppendChar(c);
+			}
+
+			module.Arguments.Add(argument.TrimStartAndEnd());
+		}
+	}
+}
+
+// Compiles a parameter expression. An expression is a sum of terms, and each term is a product of numbers, parameter names and rand(min,max). Only one term can use a parameter or rand(), the others must be numbers.
+static LParamExpression ParseExpression(const FString& text, const TArray<FString>& names)
+{
+	LParamExpression expression;
+	expression.Param = INDEX_NONE;
+	expression.Scale = 0;
+	expression.RandMin = 1;
+	expression.RandMax = 1;
+	expression.Offset = 0;
+
+	const FString clean = text.Replace(TEXT(" "), TEXT(""));
+	bool bHasVariableTerm = false;
+
+	// Split into terms on + and -, unless they are inside brackets or the sign of a number.
+	int32 start = 0;
+	int32 depth = 0;
+	for (int32 i = 0; i <= clean.Len(); i++)
+	{
+		const TCHAR c = i < clean.Len() ? clean[i] : 0;
+
+		if (c == '(')
+		{
+			depth++;
+		}
+		else if (c == ')')
+		{
+			depth--;
+		}
+
+		const bool bIsSign = (c == '+' || c == '-') && depth == 0 && i > start && clean[i - 1] != '*' && clean[i - 1] != 'e' && clean[i - 1] != 'E';
+		if (c != 0 && !bIsSign)
+		{
+			continue;
+		}
+
+		// Parse the term's factors.
+		FString term = clean.Mid(start, i - start);
+		start = i;
+
+		if (term.IsEmpty())
+		{
+			continue;
+		}
+
+		float scale = 1;
+		if (term.RemoveFromStart(TEXT("-")))
+		{
+			scale = -1;
+		}
+		else
+		{
+			term.RemoveFromStart(TEXT("+"));
+		}
+
+		int32 param = INDEX_NONE;
+		float randMin = 1;
+		float randMax = 1;
+		bool bIsVariable = false;
+
+		TArray<FString> factors;
+		term.ParseIntoArray(factors, TEXT("*"));
+
+		for (const FString& factor : factors)
+		{
+			FString low, high;
+			if (factor.StartsWith(TEXT("rand(")) && factor.EndsWith(TEXT(")")) && factor.Mid(5, factor.Len() - 6).Split(TEXT(","), &low, &high))
+			{
+				randMin = FCString::Atof(*low);
+				randMax = FCString::Atof(*high);
+				bIsVariable = true;
+			}
+			else if (FCString::IsNumeric(*factor))
+			{
+				scale *= FCString::Atof(*factor);
+			}
+			else if (names.Find(factor) != INDEX_NONE && names.Find(factor) < LParam_Count && param == INDEX_NONE)
+			{
+				param = names.Find(factor);
+				bIsVariable = true;
+			}
+			else
+			{
+				UE_LOG(LogTemp, Warning, TEXT("LGrammar: can't use '%s' in parameter expression '%s', treating it as 0."), *factor, *text);
+				scale = 0;
+			}
+		}
+
+		if (!bIsVariable)
+		{
+			expression.Offset += scale;
+		}
+		else if (!bHasVariableTerm)
+		{
+			bHasVariableTerm = true;
+			expression.Param = param;
+			expression.Scale = scale;
+			expression.RandMin = randMin;
+			expression.RandMax = randMax;
+		}
+		else
+		{
+			UE_LOG(LogTemp, Warning, TEXT("LGrammar: only one term can use a parameter in '%s', ignoring '%s'."), *text, *term);
+		}
+	}
+
+	return expression;
+}
+
+// Returns the branch depth of a module from the number of branches open before it, and updates that number.
+static uint8 StepDepth(TCHAR c, int32& depth)
+{
+	if (c == '[')
+	{
+		return (uint8)FMath::Min(depth++, (int32)MAX_uint8);
+	}
+	else if (c == ']')
+	{
+		depth = FMath::Max(depth - 1, 0);
+	}
+
+	return (uint8)FMath::Min(depth, (int32)MAX_uint8);
+}
+
+// Splits a predecessor written as "left<symbols>right" into its left context, the symbols it replaces and its right context. Either context can be left out. Returns the symbols it replaces.
+static FString SplitContext(const FString& text, FString& left, FString& right)
+{
+	int32 leftEnd = INDEX_NONE;
+	int32 rightStart = INDEX_NONE;
+	int32 depth = 0;
+
+	// Brackets hold parameters, so only look for context outside of them.
+	for (int32 i = 0; i < text.Len(); i++)
+	{
+		const TCHAR c = text[i];
+
+		if (c == '(')
+		{
+			depth++;
+		}
+		else if (c == ')')
+		{
+			depth--;
+		}
+		else if (depth == 0 && c == '<' && leftEnd == INDEX_NONE && rightStart == INDEX_NONE)
+		{
+			leftEnd = i;
+		}
+		else if (depth == 0 && c == '>' && rightStart == INDEX_NONE)
+		{
+			rightStart = i;
+		}
+	}
+
+	const int32 begin = leftEnd == INDEX_NONE ? 0 : leftEnd + 1;
+	const int32 end = rightStart == INDEX_NONE ? text.Len() : rightStart;
+
+	left = leftEnd == INDEX_NONE ? FString() : text.Left(leftEnd);
+	right = rightStart == INDEX_NONE ? FString() : text.Mid(rightStart + 1);
+
+	return text.Mid(begin, end - begin);
+}
+
+// Turns the parsed rules into a production table. Each symbol gets a group of productions that can replace it, so rewriting a symbol only has to look at its own rules. Rules with more than one symbol or context are found with an automaton, and get groups of their own.
+void LGrammar::Compile(const FString& axiom)
+{
+	SCOPE_CYCLE_COUNTER(STAT_Compile)
+	{
+		Alphabet.Reset();
+		Groups.Reset();
+		Productions.Reset();
+		Successors.Reset();
+		SuccessorParams.Reset();
+		SuccessorDepths.Reset();
+		Patterns.Reset();
+		Transitions.Reset();
+		OutputOffsets.Reset();
+		Outputs.Reset();
+		DictionaryLinks.Reset();
+		bIsParametric = false;
+
+		// The lightning symbols always come first, in the order of ELSymbol.
+		AddSymbol('F');
+		AddSymbol('+');
+		AddSymbol('-');
+		AddSymbol('[');
+		AddSymbol(']');
+
+		// Convert the axiom into symbols and modules, which are also the starting symbols.
+		TArray<LParsedModule> parsedAxiom;
+		ParseModules(axiom, parsedAxiom);
+
+		Axiom.Reset();
+		AxiomModules.Reset();
+		int32 axiomDepth = 0;
+
+		for (const LParsedModule& parsed : parsedAxiom)
+		{
+			int32 symbol = AddSymbol(parsed.Symbol);
+			if (symbol != INDEX_NONE)
+			{
+				Axiom.Add((uint8)symbol);
+
+				// The axiom's parameters must be numbers.
+				LModule& module = AxiomModules.AddDefaulted_GetRef();
+				module.Symbol = (uint8)symbol;
+				module.Depth = StepDepth(parsed.Symbol, axiomDepth);
+
+				for (int32 p = 0; p < LParam_Count; p++)
+				{
+					module.Params[p] = p < parsed.Arguments.Num() ? FCString::Atof(*parsed.Arguments[p]) : 0.0f;
+				}
+
+				bIsParametric |= parsed.Arguments.Num() > 0;
+			}
+		}
+
+		ResetSymbols();
+
+		// Split each rule into its context and the modules it replaces, and add every char used by the rules to the alphabet so that each symbol has a group before productions are added.
+		TArray<TArray<LParsedModule>> predecessors;
+		TArray<TArray<LParsedModule>> successors;
+		TArray<TArray<uint8>> ruleSymbols;
+		TArray<LPattern> rulePatterns;
+		predecessors.SetNum(RulesArray.Num());
+		successors.SetNum(RulesArray.Num());
+		ruleSymbols.SetNum(RulesArray.Num());
+		rulePatterns.SetNum(RulesArray.Num());
+
+		for (int32 r = 0; r < RulesArray.Num(); r++)
+		{
+			FString left, right;
+			TArray<LParsedModule> leftModules, rightModules;
+
+			ParseModules(SplitContext(RulesArray[r].ToReplace, left, right), predecessors[r]);
+			ParseModules(left, leftModules);
+			ParseModules(right, rightModules);
+			ParseModules(RulesArray[r].Rule, successors[r]);
+
+			// The whole pattern as symbols, along with the length of each part.
+			auto addPart = [this, &ruleSymbols, r](const TArray<LParsedModule>& part)
+			{
+				int32 length = 0;
+
+				for (const LParsedModule& module : part)
+				{
+					int32 symbol = AddSymbol(module.Symbol);
+					if (symbol != INDEX_NONE)
+					{
+						ruleSymbols[r].Add((uint8)symbol);
+						length++;
+					}
+
+					bIsParametric |= module.Arguments.Num() > 0;
+				}
+
+				return length;
+			};
+
+			rulePatterns[r].Group = INDEX_NONE;
+			rulePatterns[r].LeftLength = addPart(leftModules);
+			rulePatterns[r].Length = addPart(predecessors[r]);
+			rulePatterns[r].RightLength = addPart(rightModules);
+
+			if (rulePatterns[r].Length == 0)
+			{
+				UE_LOG(LogTemp, Warning, TEXT("LGrammar: rule '%s' has nothing to replace, ignoring it."), *RulesArray[r].ToReplace);
+			}
+
+			for (const LParsedModule& module : successors[r])
+			{
+				AddSymbol(module.Symbol);
+				bIsParametric |= module.Arguments.Num() > 0;
+			}
+		}
+
+		// Rules that replace a single symbol without context are grouped by that symbol. The rest are patterns.
+		auto isSingleSymbol = [&rulePatterns](int32 r)
+		{
+			return rulePatterns[r].Length == 1 && rulePatterns[r].LeftLength == 0 && rulePatterns[r].RightLength == 0;
+		};
+
+		// Adds a rule's production to a group. Returns false if the group is full.
+		auto addProduction = [this, &predecessors, &successors](LProductionGroup& group, int32 r)
+		{
+			// Choices are stored as uint8, so a group can't have more productions than that.
+			if (group.Num == KeepSymbol)
+			{
+				UE_LOG(LogTemp, Warning, TEXT("LGrammar: too many rules for '%s', ignoring the rest."), *RulesArray[r].ToReplace);
+				return false;
+			}
+
+			// Store the successor as symbols, along with their parameter expressions and branch depths. Parameters are named by the first module being replaced.
+			LProduction production;
+			production.Offset = Successors.Num();
+			production.Length = 0;
+			production.Probability = RulesArray[r].Probability;
+
+			const TArray<FString>& names = predecessors[r][0].Arguments;
+			int32 depth = 0;
+
+			for (const LParsedModule& module : successors[r])
+			{
+				int32 successor = AddSymbol(module.Symbol);
+				if (successor != INDEX_NONE)
+				{
+					Successors.Add((uint8)successor);
+					SuccessorDepths.Add(StepDepth(module.Symbol, depth));
+
+					// Parameters that aren't written are kept from the module being replaced.
+					for (int32 p = 0; p < LParam_Count; p++)
+					{
+						if (p < module.Arguments.Num())
+						{
+							SuccessorParams.Add(ParseExpression(module.Arguments[p], names));
+						}
+						else
+						{
+							SuccessorParams.Add({ p, 1.0f, 1.0f, 1.0f, 0.0f });
+						}
+					}
+
+					production.Length++;
+				}
+			}
+
+			Productions.Add(production);
+			group.Num++;
+			return true;
+		};
+
+		Groups.SetNum(Alphabet.Num());
+
+		// Group the single symbol rules by the symbol they replace.
+		for (int32 symbol = 0; symbol < Alphabet.Num(); symbol++)
+		{
+			LProductionGroup& group = Groups[symbol];
+			group.First = Productions.Num();
+			group.Num = 0;
+
+			for (int32 r = 0; r < RulesArray.Num(); r++)
+			{
+				if (isSingleSymbol(r) && ruleSymbols[r][0] == symbol && !addProduction(group, r))
+				{
+					break;
+				}
+			}
+
+			// Each group is selected from on its own, so its probabilities are normalized separately.
+			BuildAliasTable(group);
+		}
+
+		// Each distinct pattern gets its own group, after the symbol groups. Rules with the same pattern are grouped together, in the order they were first written.
+		TArray<TArray<uint8>> patternSymbols;
+
+		for (int32 first = 0; first < RulesArray.Num(); first++)
+		{
+			auto isSamePattern = [&](int32 r)
+			{
+				return ruleSymbols[r] == ruleSymbols[first] && rulePatterns[r].LeftLength == rulePatterns[first].LeftLength && rulePatterns[r].Length == rulePatterns[first].Length;
+			};
+
+			// Skip rules that belong to an earlier pattern.
+			bool bIsFirst = !isSingleSymbol(first) && rulePatterns[first].Length > 0;
+			for (int32 r = 0; r < first && bIsFirst; r++)
+			{
+				bIsFirst = isSingleSymbol(r) || !isSamePattern(r);
+			}
+
+			if (!bIsFirst)
+			{
+				continue;
+			}
+
+			LPattern pattern = rulePatterns[first];
+			pattern.Group = Groups.Num();
+
+			LProductionGroup& group = Groups.AddDefaulted_GetRef();
+			group.First = Productions.Num();
+			group.Num = 0;
+
+			for (int32 r = first; r < RulesArray.Num(); r++)
+			{
+				if (!isSingleSymbol(r) && isSamePattern(r) && !addProduction(group, r))
+				{
+					break;
+				}
+			}
+
+			BuildAliasTable(group);
+
+			// Patterns that can never be selected are left out, so their symbols are rewritten by their own groups instead.
+			if (group.Num > 0)
+			{
+				Patterns.Add(pattern);
+				patternSymbols.Add(ruleSymbols[first]);
+			}
+		}
+
+		// Sort the patterns by priority, so that overlapping matches only have to compare indices. Equal patterns keep the order they were written in.
+		TArray<int32> order;
+		for (int32 p = 0; p < Patterns.Num(); p++)
+		{
+			order.Add(p);
+		}
+
+		order.StableSort([this](int32 a, int32 b)
+		{
+			const LPattern& patternA = Patterns[a];
+			const LPattern& patternB = Patterns[b];
+
+			if (patternA.Length != patternB.Length)
+			{
+				return patternA.Length > patternB.Length;
+			}
+
+			return patternA.LeftLength + patternA.RightLength > patternB.LeftLength + patternB.RightLength;
+		});
+
+		TArray<LPattern> sortedPatterns;
+		TArray<TArray<uint8>> sortedSymbols;
+		for (int32 p : order)
+		{
+			sortedPatterns.Add(Patterns[p]);
+			sortedSymbols.Add(MoveTemp(patternSymbols[p]));
+		}
+
+		Patterns = MoveTemp(sortedPatterns);
+		BuildAutomaton(sortedSymbols);
+	}
+}
+
+// Builds an Aho-Corasick automaton over the patterns. The patterns are stored in a trie, and each state's failure link points to the longest suffix of its symbols that is also in the trie. Missing transitions are filled in from the failure links, so matching never has to follow them.
+void LGrammar::BuildAutomaton(const TArray<TArray<uint8>>& patternSymbols)
+{
+	const int32 alphabetSize = Alphabet.Num();
+
+	// Build the trie. State 0 is the root, and -1 is a transition that hasn't been added yet.
+	TArray<TArray<int32>> stateOutputs;
+	stateOutputs.AddDefaulted();
+	Transitions.Init(INDEX_NONE, alphabetSize);
+
+	for (int32 p = 0; p < patternSymbols.Num(); p++)
+	{
+		int32 state = 0;
+
+		for (uint8 symbol : patternSymbols[p])
+		{
+			int32 next = Transitions[state * alphabetSize + symbol];
+
+			if (next == INDEX_NONE)
+			{
+				next = stateOutputs.Num();
+				Transitions[state * alphabetSize + symbol] = next;
+				Transitions.AddUninitialized(alphabetSize);
+				FMemory::Memset(Transitions.GetData() + next * alphabetSize, 0xFF, alphabetSize * sizeof(int32));
+				stateOutputs.AddDefaulted();
+			}
+
+			state = next;
+		}
+
+		stateOutputs[state].Add(p);
+	}
+
+	const int32 numStates = stateOutputs.Num();
+
+	// Visit the states in order of depth, so each state's failure link is finished before the states below it.
+	TArray<int32> failureLinks;
+	TArray<int32> queue;
+	failureLinks.Init(0, numStates);
+	DictionaryLinks.Init(INDEX_NONE, numStates);
+	queue.Reserve(numStates);
+
+	for (int32 symbol = 0; symbol < alphabetSize; symbol++)
+	{
+		int32& next = Transitions[symbol];
+
+		if (next == INDEX_NONE)
+		{
+			next = 0;
+		}
+		else
+		{
+			queue.Add(next);
+		}
+	}
+
+	for (int32 head = 0; head < queue.Num(); head++)
+	{
+		const int32 state = queue[head];
+		const int32 failure = failureLinks[state];
+
+		// The dictionary link skips down the failure links to the next state that ends a pattern.
+		DictionaryLinks[state] = stateOutputs[failure].Num() > 0 ? failure : DictionaryLinks[failure];
+
+		for (int32 symbol = 0; symbol < alphabetSize; symbol++)
+		{
+			int32& next = Transitions[state * alphabetSize + symbol];
+
+			if (next == INDEX_NONE)
+			{
+				next = Transitions[failure * alphabetSize + symbol];
+			}
+			else
+			{
+				failureLinks[next] = Transitions[failure * alphabetSize + symbol];
+				queue.Add(next);
+			}
+		}
+	}
+
+	// Flatten the outputs of each state.
+	OutputOffsets.SetNumUninitialized(numStates + 1);
+	Outputs.Reset();
+
+	for (int32 state = 0; state < numStates; state++)
+	{
+		OutputOffsets[state] = Outputs.Num();
+		Outputs.Append(stateOutputs[state]);
+	}
+
+	OutputOffsets[numStates] = Outputs.Num();
+}
+
+// Builds the alias table for a group using Vose's method. Each production gets a column with equal chance of being picked. A column holds part of its own production's probability, and the rest of it is given to an alias production, so selecting a production takes a single random number and lookup regardless of how many rules there are.
+void LGrammar::BuildAliasTable(LProductionGroup& group)
+{
+	float totalProbability = 0;
+	for (int32 i = group.First; i < group.First + group.Num; i++)
+	{
+		totalProbability += FMath::Max(Productions[i].Probability, 0.0f);
+	}
+
+	// If none of the productions can be selected, remove them so the symbol is left unchanged.
+	if (totalProbability <= 0)
+	{
+		group.Num = 0;
+		return;
+	}
+
+	// Scaled probabilities, where 1 is the size of a column.
+	TArray<float, TInlineAllocator<16>> scaled;
+	TArray<int32, TInlineAllocator<16>> underFull;
+	TArray<int32, TInlineAllocator<16>> overFull;
+
+	for (int32 i = 0; i < group.Num; i++)
+	{
+		LProduction& production = Productions[group.First + i];
+		production.Probability = FMath::Max(production.Probability, 0.0f) / totalProbability;
+		production.AliasProbability = 1.0f;
+		production.Alias = i;
+
+		scaled.Add(production.Probability * group.Num);
+
+		if (scaled[i] < 1.0f)
+		{
+			underFull.Add(i);
+		}
+		else
+		{
+			overFull.Add(i);
+		}
+	}
+
+	// Fill each under-full column with probability taken from an over-full one.
+	while (!underFull.IsEmpty() && !overFull.IsEmpty())
+	{
+		int32 less = underFull.Pop(false);
+		int32 more = overFull.Pop(false);
+
+		Productions[group.First + less].AliasProbability = scaled[less];
+		Productions[group.First + less].Alias = more;
+
+		scaled[more] = (scaled[more] + scaled[less]) - 1.0f;
+
+		if (scaled[more] < 1.0f)
+		{
+			underFull.Add(more);
+		}
+		else
+		{
+			overFull.Add(more);
+		}
+	}
+
+	// Whatever is left is full, apart from rounding errors, so keeps its own production.
+	for (int32 i : underFull)
+	{
+		Productions[group.First + i].AliasProbability = 1.0f;
+	}
+	for (int32 i : overFull)
+	{
+		Productions[group.First + i].AliasProbability = 1.0f;
+	}
+}
+
+// Returns the resulting string.
+FString LGrammar::GetResult() const
+{
+	FString result;
+
+	// Convert each symbol back into the char it represents. Parametric grammars give the symbols of their modules, without parameters.
+	if (bIsParametric)
+	{
+		result.Reserve(Modules.Num());
+
+		for (const LModule& module : Modules)
+		{
+			result.AppendChar(Alphabet[module.Symbol]);
+		}
+	}
+	else if (bIsPacked)
+	{
+		result.Reserve(PackedSymbols.Num());
+
+		for (int32 i = 0; i < PackedSymbols.Num(); i++)
+		{
+			result.AppendChar(Alphabet[PackedSymbols[i]]);
+		}
+	}
+	else
+	{
+		result.Reserve(Symbols.Num());
+
+		for (uint8 symbol : Symbols)
+		{
+			result.AppendChar(Alphabet[symbol]);
+		}
+	}
+
+	return result;
+}
+
+// Sets the number of elements in a buffer without any growth slack. Memory is only reallocated when the buffer is too small, and its old contents are thrown away rather than copied.
+template <typename ElementType>
+static void ResizeExact(TArray<ElementType>& buffer, int32 num)
+{
+	if (buffer.Max() < num)
+	{
+		buffer.Empty(num);
+	}
+
+	buffer.SetNumUninitialized(num, false);
+}
+
+// Number of cores to spread the chunks over. The game thread helps with parallel work, so it counts as a worker.
+int32 LGrammar::GetNumWorkers(int32 numChunks) const
+{
+	int32 workers = FTaskGraphInterface::Get().GetNumWorkerThreads() + 1;
+
+	if (MaxWorkers > 0)
+	{
+		workers = FMath::Min(workers, MaxWorkers);
+	}
+
+	return FMath::Clamp(workers, 1, numChunks);
+}
+
+// Runs a function for every chunk. Each worker takes every nth chunk, so work is evenly spread without any scheduling between chunks.
+void LGrammar::ForEachChunk(int32 numChunks, TFunctionRef<void(int32)> function) const
+{
+	const int32 numWorkers = GetNumWorkers(numChunks);
+
+	if (numWorkers <= 1)
+	{
+		for (int32 chunk = 0; chunk < numChunks; chunk++)
+		{
+			function(chunk);
+		}
+	}
+	else
+	{
+		ParallelFor(numWorkers, [&function, numChunks, numWorkers](int32 worker)
+		{
+			for (int32 chunk = worker; chunk < numChunks; chunk += numWorkers)
+			{
+				function(chunk);
+			}
+		});
+	}
+}
+
+// Returns the symbol of a module, so patterns can be matched against both symbols and modules.
+static uint8 GetSymbol(uint8 symbol)
+{
+	return symbol;
+}
+
+static uint8 GetSymbol(const LModule& module)
+{
+	return module.Symbol;
+}
+
+// Finds the patterns in a single pass over the symbols. The automaton takes one step per symbol, and each match is found by following dictionary links from the current state, so the cost depends on the length of the string and the number of matches rather than the number of rules.
+// Each pattern is first recorded at the symbol it starts replacing, keeping the one with the highest priority. A second pass then goes through the matches in order, so that a pattern replaces symbols that an earlier match hasn't already replaced.
+template <typename SymbolType>
+void LGrammar::FindMatches(const SymbolType* symbols, int32 num)
+{
+	SCOPE_CYCLE_COUNTER(STAT_Match)
+	{
+		ResizeExact(Matches, num);
+
+		const int32 alphabetSize = Alphabet.Num();
+		int32* matches = Matches.GetData();
+		int32 state = 0;
+
+		for (int32 j = 0; j < num; j++)
+		{
+			matches[j] = INDEX_NONE;
+			state = Transitions[state * alphabetSize + GetSymbol(symbols[j])];
+
+			// Every pattern that ends at this symbol.
+			for (int32 output = state; output != INDEX_NONE; output = DictionaryLinks[output])
+			{
+				for (int32 k = OutputOffsets[output]; k < OutputOffsets[output + 1]; k++)
+				{
+					const int32 pattern = Outputs[k];
+					const int32 start = j - Patterns[pattern].RightLength - Patterns[pattern].Length + 1;
+
+					// Patterns are sorted by priority, so a lower index wins.
+					if (matches[start] == INDEX_NONE || pattern < matches[start])
+					{
+						matches[start] = pattern;
+					}
+				}
+			}
+		}
+
+		// Replace the symbols of each match with its group, unless an earlier match has already replaced them.
+		for (int32 j = 0; j < num;)
+		{
+			if (matches[j] == INDEX_NONE)
+			{
+				j++;
+				continue;
+			}
+
+			const LPattern& pattern = Patterns[matches[j]];
+			matches[j] = pattern.Group;
+
+			for (int32 k = 1; k < pattern.Length; k++)
+			{
+				matches[j + k] = MatchConsumed;
+			}
+
+			j += pattern.Length;
+		}
+	}
+}
+
+// First pass of an iteration. Selects the production of each symbol in a chunk and adds up the chunk's output length.
+int64 LGrammar::SelectChunk(int32 chunk, int32 iteration)
+{
+	const int32 begin = chunk * ChunkSize;
+	const int32 end = FMath::Min(begin + ChunkSize, Symbols.Num());
+
+	// Random stream for this chunk, based on the seed, iteration and chunk. Numbers are generated in blocks and taken one per symbol.
+	LRandomBlock random((uint32)Seed, ((uint64)LRandomStream_Grammar << 48) | ((uint64)iteration << 32) | (uint32)chunk);
+
+	const int32* matches = Patterns.Num() > 0 ? Matches.GetData() : nullptr;
+	int64 length = 0;
+
+	for (int32 j = begin; j < end; j++)
+	{
+		int32 groupIndex = Symbols[j];
+
+		// Symbols matched by a pattern use the pattern's group. The rest of the symbols it replaces are left out of the output.
+		if (matches && matches[j] != INDEX_NONE)
+		{
+			if (matches[j] == MatchConsumed)
+			{
+				continue;
+			}
+
+			groupIndex = matches[j];
+		}
+
+		const LProductionGroup& group = Groups[groupIndex];
+
+		// Symbols without rules are left unchanged. Otherwise a production is selected from the symbol's alias table with a single random number.
+		if (group.Num == 0)
+		{
+			Choices[j] = KeepSymbol;
+			length += 1;
+		}
+		else
+		{
+			const int32 production = SelectProduction(group, random.FRand());
+			Choices[j] = (uint8)(production - group.First);
+			length += Productions[production].Length;
+		}
+	}
+
+	return length;
+}
+
+// Second pass of an iteration. The running total of production lengths gives the position of each production in the output.
+void LGrammar::WriteChunk(int32 chunk, int32 offset)
+{
+	const int32 begin = chunk * ChunkSize;
+	const int32 end = FMath::Min(begin + ChunkSize, Symbols.Num());
+
+	const uint8* successors = Successors.GetData();
+	const int32* matches = Patterns.Num() > 0 ? Matches.GetData() : nullptr;
+	uint8* output = NextSymbols.GetData();
+
+	for (int32 j = begin; j < end; j++)
+	{
+		const uint8 symbol = Symbols[j];
+		int32 groupIndex = symbol;
+
+		if (matches && matches[j] != INDEX_NONE)
+		{
+			if (matches[j] == MatchConsumed)
+			{
+				continue;
+			}
+
+			groupIndex = matches[j];
+		}
+
+		if (Choices[j] == KeepSymbol)
+		{
+			output[offset++] = symbol;
+		}
+		else
+		{
+			const LProduction& selected = Productions[Groups[groupIndex].First + Choices[j]];
+			FMemory::Memcpy(output + offset, successors + selected.Offset, selected.Length);
+			offset += selected.Length;
+		}
+	}
+}
+
+// Output is capped at MAX_int32 as arrays are indexed with int32, as well as by the budget.
+int64 LGrammar::GetSymbolCap(int32 num, int64 inputBytes, int64 outputBytes) const
+{
+	int64 cap = MAX_int32;
+
+	if (MaxSymbols > 0)
+	{
+		cap = FMath::Min(cap, MaxSymbols);
+	}
+
+	// The input, its choices and matches are all kept while the output is written, so they come out of the memory budget first.
+	if (MaxBytes > 0)
+	{
+		cap = FMath::Min(cap, (MaxBytes - num * inputBytes) / outputBytes);
+	}
+
+	return FMath::Max(cap, (int64)0);
+}
+
+// A pattern replaces its own symbol and the consumed symbols after it.
+template <typename SymbolType>
+int32 LGrammar::GetReplacementLength(const SymbolType* symbols, int32 num, int32 j, int32& replaced) const
+{
+	const int32* matches = Patterns.Num() > 0 ? Matches.GetData() : nullptr;
+
+	replaced = 1;
+	while (matches && j + replaced < num && matches[j + replaced] == MatchConsumed)
+	{
+		replaced++;
+	}
+
+	if (Choices[j] == KeepSymbol)
+	{
+		return 1;
+	}
+
+	const int32 groupIndex = (matches && matches[j] != INDEX_NONE) ? matches[j] : GetSymbol(symbols[j]);
+	return Productions[Groups[groupIndex].First + Choices[j]].Length;
+}
+
+// Symbols whose productions don't grow the string are always rewritten. Of the rest, the same fraction of growth is allowed up to every point in the string, so the symbols that are kept are spread evenly rather than all being at the end.
+// Each symbol's subtree doesn't depend on the symbols around it, so a string with some symbols kept is the same as one where those symbols had one fewer iteration, and its branches stay balanced.
+// This runs on the whole string at once, as a kept pattern gives its symbols back to the chunk after it. It only runs on the last iteration, so isn't worth splitting into chunks.
+template <typename SymbolType>
+int64 LGrammar::TrimChoices(const SymbolType* symbols, int32 num, int64 cap)
+{
+	int32* matches = Patterns.Num() > 0 ? Matches.GetData() : nullptr;
+	uint8* choices = Choices.GetData();
+	int32 replaced;
+
+	// The length of the output if nothing that grows is rewritten, and the growth of everything that does.
+	int64 baseLength = 0;
+	int64 totalGrowth = 0;
 
-	// Starting value for probability.
-	TotalProbability = 0;
+	for (int32 j = 0; j < num; j++)
+	{
+		if (matches && matches[j] == MatchConsumed)
+		{
+			continue;
+		}
+
+		const int32 length = GetReplacementLength(symbols, num, j, replaced);
+
+		if (length > replaced)
+		{
+			baseLength += replaced;
+			totalGrowth += length - replaced;
+		}
+		else
+		{
+			baseLength += length;
+		}
+	}
+
+	const double fraction = totalGrowth > 0 ? FMath::Clamp((double)(cap - baseLength) / totalGrowth, 0.0, 1.0) : 1.0;
+
+	const int32 numChunks = FMath::DivideAndRoundUp(num, ChunkSize);
+	ChunkOffsets.SetNumUninitialized(numChunks + 1, false);
 
-	// Iterate through the rule strings to create LRules.
-	for (int i = 0; i < rules.Num(); i++)
+	int64 seenGrowth = 0;
+	int64 usedGrowth = 0;
+	int64 offset = 0;
+
+	for (int32 j = 0; j < num; j++)
 	{
-		// The three parts of the rule strings. To the left of " => " is the string to be replaced. Between " => " and " (" is the rule itself. The probability is between " (" and ")".
-		int pos1 = rules[i].Find(" => ");
-		int pos2 = rules[i].Find(" (");
-		int pos3 = rules[i].Find(")");
+		if (j % ChunkSize == 0)
+		{
+			ChunkOffsets[j / ChunkSize] = offset;
+		}
+
+		if (matches && matches[j] == MatchConsumed)
+		{
+			continue;
+		}
+
+		const int32 length = GetReplacementLength(symbols, num, j, replaced);
+
+		if (length <= replaced)
+		{
+			offset += length;
+			continue;
+		}
 
-		// If rule separator and brackets are present in the string...
-		if (pos1 != -1 && pos2 != -1)
+		// Rewrite the symbol if the growth so far stays within the fraction of the growth seen so far.
+		seenGrowth += length - replaced;
+
+		if (usedGrowth + (length - replaced) <= (int64)(fraction * seenGrowth))
 		{
-			// Separate out the string to be replaced, the string to act as the rule, and the probability.
-			FString stringToReplace = rules[i].Mid(0, pos1);
-			FString rule = rules[i].Mid(pos1 + 4, pos2 - pos1 - 4); // 4 is length of " => "
-			FString probability = rules[i].Mid(pos2 + 3, pos3); // 3 is position after " ("
+			usedGrowth += length - replaced;
+			offset += length;
+			continue;
+		}
 
-			// Create an L system rule with these properties.
-			LRule r(stringToReplace, rule, FCString::Atof(*probability));
+		// Keep the symbol. A kept pattern keeps each of its symbols, which are then counted as they are reached.
+		choices[j] = KeepSymbol;
+		offset += 1;
 
-			// Add the rules to an array and increase total probability.
-			RulesArray.Add(r);
-			TotalProbability += r.Probability;
+		if (matches)
+		{
+			matches[j] = INDEX_NONE;
+
+			for (int32 k = 1; k < replaced; k++)
+			{
+				matches[j + k] = INDEX_NONE;
+				choices[j + k] = KeepSymbol;
+			}
 		}
 	}
 
+	ChunkOffsets[numChunks] = offset;
+	return offset;
 }
 
-LGrammar::~LGrammar()
+// Writes the same symbols as WriteChunk or WriteBuiltinChunk, a word at a time. Symbols are added to a word from its lowest bits, and each full word is written once.
+void LGrammar::WritePackedChunk(int32 chunk, int32 offset)
+{
+	constexpr int32 symbolsPerWord = LPackedSymbols::SymbolsPerWord;
+
+	const int32 begin = chunk * ChunkSize;
+	const int32 end = FMath::Min(begin + ChunkSize, Symbols.Num());
+
+	const uint8* successors = Successors.GetData();
+	const int32* matches = Patterns.Num() > 0 ? Matches.GetData() : nullptr;
+	uint64* words = PackedSymbols.GetWords();
+
+	// The chunk's first word is shared with the chunk before it, unless the chunk starts at the start of a word.
+	const int32 firstWord = offset / symbolsPerWord;
+	const bool bSharesFirstWord = offset % symbolsPerWord != 0;
+
+	int32 wordIndex = firstWord;
+	int32 slot = offset % symbolsPerWord;
+	uint64 word = 0;
+
+	auto put = [&](uint8 symbol)
+	{
+		word |= (uint64)symbol << (slot * LPackedSymbols::BitsPerSymbol);
+
+		if (++slot == symbolsPerWord)
+		{
+			if (wordIndex == firstWord && bSharesFirstWord)
+			{
+				ChunkHeadWords[chunk] = word;
+			}
+			else
+			{
+				words[wordIndex] = word;
+			}
+
+			wordIndex++;
+			slot = 0;
+			word = 0;
+		}
+	};
+
+	for (int32 j = begin; j < end; j++)
+	{
+		const uint8 symbol = Symbols[j];
+		int32 groupIndex = symbol;
+
+		if (matches && matches[j] != INDEX_NONE)
+		{
+			if (matches[j] == MatchConsumed)
+			{
+				continue;
+			}
+
+			groupIndex = matches[j];
+		}
+
+		if (Choices[j] == KeepSymbol)
+		{
+			put(symbol);
+		}
+		else if (bIsBuiltin)
+		{
+			for (int32 k = 0; k < LBuiltinGrammar::Lengths[Choices[j]]; k++)
+			{
+				put(LBuiltinGrammar::Successors[Choices[j]][k]);
+			}
+		}
+		else
+		{
+			const LProduction& selected = Productions[Groups[groupIndex].First + Choices[j]];
+
+			for (int32 k = selected.Offset; k < selected.Offset + selected.Length; k++)
+			{
+				put(successors[k]);
+			}
+		}
+	}
+
+	// The last word is shared with the chunk after it if it isn't full.
+	if (slot != 0)
+	{
+		if (wordIndex == firstWord && bSharesFirstWord)
+		{
+			ChunkHeadWords[chunk] = word;
+		}
+		else
+		{
+			ChunkTailWords[chunk] = word;
+		}
+	}
+}
+
+// The built-in rules have exactly the lightning symbols, a single group for F with the six built-in productions in order, and nothing else. The probabilities can be anything.
+void LGrammar::DetectBuiltin()
 {
+	bIsBuiltin = false;
+
+	if (bIsParametric || Patterns.Num() > 0 || Alphabet.Num() != LSymbol_Count || Groups.Num() != LSymbol_Count)
+	{
+		return;
+	}
+
+	for (int32 symbol = 0; symbol < LSymbol_Count; symbol++)
+	{
+		if (Groups[symbol].Num != (symbol == LSymbol_Forward ? LBuiltinGrammar::NumProductions : 0))
+		{
+			return;
+		}
+	}
+
+	for (int32 i = 0; i < LBuiltinGrammar::NumProductions; i++)
+	{
+		const LProduction& production = Productions[Groups[LSymbol_Forward].First + i];
+
+		if (production.Length != LBuiltinGrammar::Lengths[i] || FMemory::Memcmp(Successors.GetData() + production.Offset, LBuiltinGrammar::Successors[i], production.Length) != 0)
+		{
+			return;
+		}
+	}
+
+	bIsBuiltin = true;
 }
 
-// Returns the resulting string.
-FString LGrammar::GetResult()
+// Selects productions in the same order and from the same random numbers as SelectChunk, so the built-in path gives the same string. Only F has productions, and their lengths are constants.
+int64 LGrammar::SelectBuiltinChunk(int32 chunk, int32 iteration)
+{
+	const int32 begin = chunk * ChunkSize;
+	const int32 end = FMath::Min(begin + ChunkSize, Symbols.Num());
+
+	LRandomBlock random((uint32)Seed, ((uint64)LRandomStream_Grammar << 48) | ((uint64)iteration << 32) | (uint32)chunk);
+
+	const LProductionGroup& group = Groups[LSymbol_Forward];
+	const uint8* symbols = Symbols.GetData();
+	uint8* choices = Choices.GetData();
+	int64 length = 0;
+
+	for (int32 j = begin; j < end; j++)
+	{
+		if (symbols[j] != LSymbol_Forward)
+		{
+			choices[j] = KeepSymbol;
+			length += 1;
+			continue;
+		}
+
+		const int32 production = SelectProduction(group, random.FRand()) - group.First;
+		choices[j] = (uint8)production;
+		length += LBuiltinGrammar::Lengths[production];
+	}
+
+	return length;
+}
+
+void LGrammar::WriteBuiltinChunk(int32 chunk, int32 offset)
 {
-	return Condition;
+	const int32 begin = chunk * ChunkSize;
+	const int32 end = FMath::Min(begin + ChunkSize, Symbols.Num());
+
+	const uint8* symbols = Symbols.GetData();
+	const uint8* choices = Choices.GetData();
+	uint8* output = NextSymbols.GetData() + offset;
+
+	for (int32 j = begin; j < end; j++)
+	{
+		if (choices[j] == KeepSymbol)
+		{
+			*output++ = symbols[j];
+		}
+		else
+		{
+			output += LBuiltinGrammar::Write(choices[j], output);
+		}
+	}
 }
 
-// Iterate through the string.
+// Iterate through the string. Each iteration takes two passes - the first selects a production for every symbol and adds up the length of the result, and the second writes each production straight into a buffer of exactly that length.
+// Peak memory is the input, one choice per input symbol, and the output. When packing, the last iteration's output takes 3 bits per symbol, and the byte buffers are freed once it is written.
+// Both passes work on chunks of symbols, which are rewritten in parallel for long strings. The prefix sum is split the same way - each chunk sums its own lengths in the first pass, the chunk totals are summed here, then each chunk sums its own offsets while writing.
 void LGrammar::Iterate(int its)
 {
 	SCOPE_CYCLE_COUNTER(STAT_Iterations)
 	{
-		int loopCount = 0;
+		bIsTruncated = false;
+
+		// For the specified number of iterations...
+		for (int i = 0; i < its && !bIsTruncated; i++)
+		{
+			SCOPE_CYCLE_COUNTER(STAT_Iterate)
+			{
+				const int32 num = Symbols.Num();
+				const int32 numChunks = FMath::DivideAndRoundUp(num, ChunkSize);
+
+				// Each input symbol has a choice, and a match if there are patterns.
+				const int64 cap = GetSymbolCap(num, sizeof(uint8) * 2 + (Patterns.Num() > 0 ? sizeof(int32) : 0), sizeof(uint8));
+				if (num >= cap)
+				{
+					UE_LOG(LogTemp, Warning, TEXT("LGrammar: budget of %lld symbols reached after %d iterations, stopping early."), cap, i);
+					bIsTruncated = true;
+					break;
+				}
+
+				ResizeExact(Choices, num);
+				ChunkOffsets.SetNumUninitialized(numChunks + 1, false);
+				ChunkOffsets[0] = 0;
+
+				// Patterns are found before the chunks are rewritten, as they can cross from one chunk into the next.
+				if (Patterns.Num() > 0)
+				{
+					FindMatches(Symbols.GetData(), num);
+				}
+
+				// First pass. Selects productions and stores each chunk's length after its offset.
+				ForEachChunk(numChunks, [this, i](int32 chunk)
+				{
+					ChunkOffsets[chunk + 1] = bIsBuiltin ? SelectBuiltinChunk(chunk, i) : SelectChunk(chunk, i);
+				});
+
+				// Sum the chunk lengths to get their offsets. This is the top level of a two level scan, and the levels below it run in parallel in each pass.
+				// There is one total per 16384 symbols, so even a string of MAX_int32 symbols has 131072 of them, which are summed in well under a millisecond. Splitting them over workers would cost more to schedule than it saves.
+				for (int32 chunk = 0; chunk < numChunks; chunk++)
+				{
+					ChunkOffsets[chunk + 1] += ChunkOffsets[chunk];
+				}
+
+				SymbolsRewritten += num;
+
+				// If the whole iteration doesn't fit in the budget, only part of it is rewritten and it is the last one.
+				int64 outputLength = ChunkOffsets[numChunks];
+				if (outputLength > cap)
+				{
+					outputLength = TrimChoices(Symbols.GetData(), num, cap);
+					UE_LOG(LogTemp, Warning, TEXT("LGrammar: budget of %lld symbols reached during iteration %d, stopping early with %lld symbols."), cap, i, outputLength);
+					bIsTruncated = true;
+				}
+
+				// The last iteration can write its symbols packed, if every symbol fits in 3 bits.
+				const bool bPack = bPackSymbols && Alphabet.Num() <= LPackedSymbols::MaxAlphabetSize && (i == its - 1 || bIsTruncated);
+
+				if (bPack)
+				{
+					WritePacked(numChunks, outputLength);
+					break;
+				}
+
+				ResizeExact(NextSymbols, (int32)outputLength);
+
+				// Second pass. Each chunk writes its productions from its own offset.
+				ForEachChunk(numChunks, [this](int32 chunk)
+				{
+					if (bIsBuiltin)
+					{
+						WriteBuiltinChunk(chunk, (int32)ChunkOffsets[chunk]);
+					}
+					else
+					{
+						WriteChunk(chunk, (int32)ChunkOffsets[chunk]);
+					}
+				});
+
+				// Once each symbol has been rewritten, the new symbols become the condition for the next iteration.
+				Swap(Symbols, NextSymbols);
+			}
+		}
+	}
+}
+
+// Every word that is only written by one chunk is written directly. Words shared between chunks are cleared, then each chunk's part of them is combined in.
+void LGrammar::WritePacked(int32 numChunks, int64 outputLength)
+{
+	constexpr int32 symbolsPerWord = LPackedSymbols::SymbolsPerWord;
+
+	PackedSymbols.SetNumUninitialized((int32)outputLength);
+	ChunkHeadWords.SetNumZeroed(numChunks);
+	ChunkTailWords.SetNumZeroed(numChunks);
+
+	ForEachChunk(numChunks, [this](int32 chunk)
+	{
+		WritePackedChunk(chunk, (int32)ChunkOffsets[chunk]);
+	});
+
+	uint64* words = PackedSymbols.GetWords();
+
+	for (int32 chunk = 0; chunk < numChunks; chunk++)
+	{
+		const int64 start = ChunkOffsets[chunk];
+		const int64 end = ChunkOffsets[chunk + 1];
+
+		if (start % symbolsPerWord != 0)
+		{
+			words[start / symbolsPerWord] = 0;
+		}
+
+		if (end % symbolsPerWord != 0)
+		{
+			words[end / symbolsPerWord] = 0;
+		}
+	}
+
+	for (int32 chunk = 0; chunk < numChunks; chunk++)
+	{
+		const int64 start = ChunkOffsets[chunk];
+		const int64 end = ChunkOffsets[chunk + 1];
+		const bool bSharesFirstWord = start % symbolsPerWord != 0;
+
+		if (bSharesFirstWord)
+		{
+			words[start / symbolsPerWord] |= ChunkHeadWords[chunk];
+		}
+
+		// A chunk that ends in the word it started in stored that word as its head.
+		if (end % symbolsPerWord != 0 && !(bSharesFirstWord && start / symbolsPerWord == end / symbolsPerWord))
+		{
+			words[end / symbolsPerWord] |= ChunkTailWords[chunk];
+		}
+	}
+
+	bIsPacked = true;
+
+	// Only the packed symbols are kept.
+	Symbols.Empty();
+	NextSymbols.Empty();
+	Choices.Empty();
+	Matches.Empty();
+}
+
+// Calculates a parameter from its expression and the parameters of the module being replaced.
+static float EvaluateParam(const LParamExpression& expression, const float* params, LRandomBlock& random)
+{
+	float value = expression.Scale * (expression.Param != INDEX_NONE ? params[expression.Param] : 1.0f);
+
+	if (expression.RandMin != expression.RandMax)
+	{
+		value *= random.FRandRange(expression.RandMin, expression.RandMax);
+	}
+	else
+	{
+		value *= expression.RandMin;
+	}
+
+	return value + expression.Offset;
+}
+
+// Iterate through the modules of a parametric grammar. This uses the same two passes as Iterate, but also calculates the parameters and branch depth of each new module.
+void LGrammar::IterateParametric(int its)
+{
+	SCOPE_CYCLE_COUNTER(STAT_Iterations)
+	{
+		bIsTruncated = false;
 
 		// For the specified number of iterations...
-		for (int i = 0; i < its; i++)
+		for (int i = 0; i < its && !bIsTruncated; i++)
 		{
 			SCOPE_CYCLE_COUNTER(STAT_Iterate)
 			{
+				const int32 num = Modules.Num();
+
+				const int64 cap = GetSymbolCap(num, sizeof(LModule) + sizeof(uint8) + (Patterns.Num() > 0 ? sizeof(int32) : 0), sizeof(LModule));
+				if (num >= cap)
+				{
+					UE_LOG(LogTemp, Warning, TEXT("LGrammar: budget of %lld modules reached after %d iterations, stopping early."), cap, i);
+					bIsTruncated = true;
+					break;
+				}
 
-				// String to store the result of this iteration.
-				FString newCondition;
+				ResizeExact(Choices, num);
 
-				// Goes through each position in the string...
-				for (int j = 0; j < Condition.Len(); j++)
+				if (Patterns.Num() > 0)
 				{
-					loopCount++;
+					FindMatches(Modules.GetData(), num);
+				}
+
+				const int32* matches = Patterns.Num() > 0 ? Matches.GetData() : nullptr;
 
-					// Random number used to select a rule.
-					float random = FMath::RandRange(0.0f, TotalProbability);
-					LRule randomRule;
+				// Random numbers for this iteration, used for both selecting productions and rand() in expressions.
+				LRandomBlock random((uint32)Seed, ((uint64)LRandomStream_Grammar << 48) | ((uint64)i << 32) | MAX_uint32);
 
-					// Check each rule in the rule array's probability, and select based on the random number.
-					// Example - random number is 0.75. Rule 1 and 2 both have 0.5 probability. In first rule check, 0.75 is more than 0.5 so the probability is taken away from 0.75 resulting in 0.25. This value is then lower than rule 2's probability of 0.5, resulting in that rule being selected.
-					for (auto rule : RulesArray)
+				// First pass. Selects productions and adds up the length of the output.
+				int64 outputLength = 0;
+
+				for (int32 j = 0; j < num; j++)
+				{
+					int32 groupIndex = Modules[j].Symbol;
+
+					// Modules matched by a pattern use the pattern's group. The rest of the modules it replaces are left out of the output.
+					if (matches && matches[j] != INDEX_NONE)
 					{
-						// If the random number is lower than that rules probability, use that rule.
-						if (random <= rule.Probability)
+						if (matches[j] == MatchConsumed)
 						{
-							randomRule = rule;
-							break;
+							continue;
 						}
-						else // If not, decrease the random number by the rules probability.
+
+						groupIndex = matches[j];
+					}
+
+					const LProductionGroup& group = Groups[groupIndex];
+
+					if (group.Num == 0)
+					{
+						Choices[j] = KeepSymbol;
+						outputLength += 1;
+					}
+					else
+					{
+						const int32 production = SelectProduction(group, random.FRand());
+						Choices[j] = (uint8)(production - group.First);
+						outputLength += Productions[production].Length;
+					}
+				}
+
+				SymbolsRewritten += num;
+
+				if (outputLength > cap)
+				{
+					outputLength = TrimChoices(Modules.GetData(), num, cap);
+					UE_LOG(LogTemp, Warning, TEXT("LGrammar: budget of %lld modules reached during iteration %d, stopping early with %lld modules."), cap, i, outputLength);
+					bIsTruncated = true;
+				}
+
+				ResizeExact(NextModules, (int32)outputLength);
+
+				// Second pass. Writes each production's modules, calculating their parameters from the module they replace.
+				LModule* output = NextModules.GetData();
+				int32 offset = 0;
+
+				for (int32 j = 0; j < num; j++)
+				{
+					const LModule& module = Modules[j];
+					int32 groupIndex = module.Symbol;
+
+					if (matches && matches[j] != INDEX_NONE)
+					{
+						if (matches[j] == MatchConsumed)
 						{
-							random -= rule.Probability;
+							continue;
 						}
+
+						groupIndex = matches[j];
 					}
 
-					// Add current position in string to a new string.
-					FString current;
-					current += Condition[j];
+					if (Choices[j] == KeepSymbol)
+					{
+						output[offset++] = module;
+						continue;
+					}
 
-					// String to be added to the condition. This will be changed if the rule replacement criteria is met, otherwise the same string will be added to the final string.
-					FString replacement = current;
+					// Parameters are calculated from the first module being replaced.
+					const LProduction& selected = Productions[Groups[groupIndex].First + Choices[j]];
 
-					// If the string matches the rule's replacement string, replace the string with the rule.
-					if (randomRule.ToReplace == current)
+					for (int32 k = selected.Offset; k < selected.Offset + selected.Length; k++)
 					{
-						//replacement = randomRule.Rule;
-						replacement = "F[+F]";
-					}
+						LModule& next = output[offset++];
+						next.Symbol = Successors[k];
+						next.Depth = (uint8)FMath::Min(module.Depth + SuccessorDepths[k], (int32)MAX_uint8);
 
-					// Add to the condition.
-					newCondition += replacement;
+						for (int32 p = 0; p < LParam_Count; p++)
+						{
+							next.Params[p] = EvaluateParam(SuccessorParams[k * LParam_Count + p], module.Params, random);
+						}
+					}
 				}
 
-				// Once each part of the string has been iterated through, set the condition to the new string.
-				Condition = newCondition;
-
-				
+				// Once each module has been rewritten, the new modules become the condition for the next iteration.
+				Swap(Modules, NextModules);
 			}
 		}
-
-		GEngine->AddOnScreenDebugMessage(-1, 15.0f, FColor::Yellow, FString::Printf(TEXT("Loop count: %d"), loopCount));
-
 	}
 }
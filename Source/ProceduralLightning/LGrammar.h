@@ -3,32 +3,376 @@
 
 #include "CoreMinimal.h"
 #include "LRule.h"
+#include "LGrammarBuilder.h"
+#include "LPackedSymbols.h"
 
 DECLARE_STATS_GROUP(TEXT("LSystem"), STATGROUP_LSystem, STATCAT_Advanced);
 DECLARE_CYCLE_STAT(TEXT("Iterations"), STAT_Iterations, STATGROUP_LSystem);
 DECLARE_CYCLE_STAT(TEXT("Iterate"), STAT_Iterate, STATGROUP_LSystem);
+DECLARE_CYCLE_STAT(TEXT("Compile"), STAT_Compile, STATGROUP_LSystem);
+DECLARE_CYCLE_STAT(TEXT("Match"), STAT_Match, STATGROUP_LSystem);
+
+// Symbols drawn by the lightning generator. These always take the first indices of a compiled grammar's alphabet, so symbol buffers can be read without looking up the alphabet.
+enum ELSymbol : uint8
+{
+	LSymbol_Forward = 0, // 'F'
+	LSymbol_RotateRight, // '+'
+	LSymbol_RotateLeft, // '-'
+	LSymbol_Save, // '['
+	LSymbol_Return, // ']'
+	LSymbol_Count
+};
+
+// A single production of the compiled grammar. Its successor symbols are stored in the grammar's successor array, starting at Offset.
+struct LProduction
+{
+	int32 Offset;
+	int32 Length;
+
+	// Probability of this production being selected, normalized within its group.
+	float Probability;
+
+	// Alias table column. The production is kept if the draw within the column is below AliasProbability, otherwise the production at index Alias in the group is used.
+	float AliasProbability;
+	int32 Alias;
+};
+
+// The productions that can replace a symbol. These are stored next to each other in the production array, starting at First.
+struct LProductionGroup
+{
+	int32 First;
+	int32 Num;
+};
+
+// A rule that replaces more than one symbol, or that only applies when the symbols around it match, such as "F[" or "A<F>B".
+// The whole pattern is the left context, the replaced symbols and the right context, one after the other.
+struct LPattern
+{
+	// The group of productions used when the pattern matches.
+	int32 Group;
+
+	// The number of symbols in each part of the pattern.
+	int32 LeftLength;
+	int32 Length;
+	int32 RightLength;
+};
+
+// Parameters carried by each module of a parametric grammar.
+enum ELParam : uint8
+{
+	LParam_Length = 0,
+	LParam_Width,
+	LParam_Count
+};
+
+// A symbol with parameters, used by parametric grammars. The parameters are calculated while rewriting, so the lightning generator only has to read them when drawing.
+struct LModule
+{
+	float Params[LParam_Count];
+	uint8 Symbol;
+
+	// The number of branches that are open before this module.
+	uint8 Depth;
+};
+
+// A compiled parameter expression from a parametric rule, such as "w*0.66" or "rand(40,60)".
+// The value is Scale * the predecessor's parameter (or 1 if there is none) * a random number between RandMin and RandMax, plus Offset.
+struct LParamExpression
+{
+	int32 Param;
+	float Scale;
+	float RandMin;
+	float RandMax;
+	float Offset;
+};
+
 /**
  * 
  */
 class PROCEDURALLIGHTNING_API LGrammar
 {
 public:
-	// Constructor and destructor.
+	// Constructors and destructor.
+	LGrammar();
 	LGrammar(FString axiom, TArray<FString> rules);
+	LGrammar(const LGrammarBuilder& rules);
 	~LGrammar();
 
+	// Compiles a new set of rules, and resets the symbols to the axiom. The symbol buffers keep their memory, so a grammar can be reused between builds.
+	// Rules that are already compiled, or are in the cache, aren't compiled again.
+	void SetRules(const LGrammarBuilder& rules);
+
+	// Parses rule strings such as "F => F[+F] (0.4)" into rules, then compiles them.
+	void SetRules(const FString& axiom, const TArray<FString>& rules);
+
+	// Sets the directory that compiled grammars are saved to and loaded from. Grammars aren't cached if this is empty.
+	void SetCacheDirectory(const FString& directory) { CacheDirectory = directory; };
+
 	// Iterate through the string.
 	void Iterate(int its);
 
-	// Returns the resulting string.
-	FString GetResult();
+	// Iterate through the modules of a parametric grammar. Each production's successor parameters are calculated from the module it replaces.
+	void IterateParametric(int its);
+
+	// Whether the axiom or any rule has parameters.
+	bool IsParametric() const { return bIsParametric; };
+
+	// Returns the resulting modules of a parametric grammar.
+	const TArray<LModule>& GetModules() const { return Modules; };
+
+	// Returns the resulting string. This converts every symbol, so is slow for long strings.
+	FString GetResult() const;
+
+	// Returns the resulting symbols. Each symbol is an index into the alphabet.
+	const TArray<uint8>& GetSymbols() const { return Symbols; };
+
+	// When enabled, the last iteration writes its symbols packed into 3 bits each, if the alphabet is small enough. The byte buffers are freed once it has, so the grammar only holds the packed result.
+	void SetPackSymbols(bool bPack) { bPackSymbols = bPack; };
+
+	// Whether the result is packed. Packed results are read with GetPackedSymbols, and GetSymbols is empty.
+	bool IsPacked() const { return bIsPacked; };
+	const LPackedSymbols& GetPackedSymbols() const { return PackedSymbols; };
+
+	// Moves the resulting symbols out of the grammar, leaving it without a symbol buffer.
+	TArray<uint8> ReleaseSymbols() { return MoveTemp(Symbols); };
+
+	// Returns the chars represented by each symbol.
+	const TArray<TCHAR>& GetAlphabet() const { return Alphabet; };
+
+	// Access to the compiled grammar.
+	// *** //
+	const TArray<uint8>& GetAxiom() const { return Axiom; };
+	const TArray<LProductionGroup>& GetGroups() const { return Groups; };
+	const TArray<LProduction>& GetProductions() const { return Productions; };
+	const TArray<uint8>& GetSuccessors() const { return Successors; };
+	// *** //
+
+	// Selects a production from a group using its alias table, with a random number between 0 and 1. Returns the index of the production.
+	int32 SelectProduction(const LProductionGroup& group, float random) const
+	{
+		// The random number picks a column, and what is left of it decides between the column's production and its alias.
+		const float scaled = random * group.Num;
+		const int32 column = FMath::Min((int32)scaled, group.Num - 1);
+		const LProduction& production = Productions[group.First + column];
+
+		return group.First + ((scaled - column) < production.AliasProbability ? column : production.Alias);
+	};
+
+	// Sets the seed used to select productions. The same seed and rules always give the same result.
+	void SetSeed(int32 seed) { Seed = seed; };
+
+	// Limits the number of cores used to rewrite the string. 0 uses every available core.
+	void SetMaxWorkers(int32 workers) { MaxWorkers = workers; };
+
+	// Limits the size of the result. Once an iteration would make more than maxSymbols symbols, or its buffers would take more than maxBytes, only part of it is rewritten and the iterations after it are skipped. 0 means no limit.
+	void SetBudget(int64 maxSymbols, int64 maxBytes) { MaxSymbols = maxSymbols; MaxBytes = maxBytes; };
+
+	// Whether the last iterations stopped early because the budget was reached.
+	bool IsTruncated() const { return bIsTruncated; };
+
+	// Returns the number of symbols rewritten since the rules were set.
+	int64 GetSymbolsRewritten() const { return SymbolsRewritten; };
+
+	// Whether the rules are the lightning generator's own six rules, which are rewritten with productions known at compile time.
+	bool IsBuiltin() const { return bIsBuiltin; };
+
+	// Whether any rule replaces more than one symbol or has context. These rules need the symbols around them, so can't be expanded one symbol at a time.
+	bool HasPatterns() const { return Patterns.Num() > 0; };
 protected:
-	// The string to be iterated through.
-	FString Condition;
+	// Turns the parsed rules into a production table over the grammar's alphabet, and converts the axiom into symbols.
+	void Compile(const FString& axiom);
+
+	// Sets the symbols and modules back to the axiom.
+	void ResetSymbols();
+
+	// Compiled grammar cache. The compiled tables are saved in a binary file named after the hash of the rules, so loading a grammar doesn't need any parsing.
+	// *** //
+	// Saves the compiled tables to a file, along with the hash of the rules they were compiled from.
+	bool SaveCompiled(const FString& path);
+
+	// Loads the compiled tables from a file with a single memory map. Fails if the file doesn't exist, wasn't compiled from the same rules, or has an index outside of its tables.
+	bool LoadCompiled(const FString& path, uint64 hash);
+
+	// Whether every index in the compiled tables is inside the table it points into, so a loaded grammar can be iterated without reading out of bounds.
+	bool IsCompiledValid() const;
+
+	// Returns the cache file for a hash, or an empty string if there is no cache directory.
+	FString GetCacheFile(uint64 hash) const;
+
+	// Calls a function on each compiled table, in the order they are stored in the cache.
+	template <typename FunctionType>
+	void ForEachTable(FunctionType&& function);
+
+	// The directory compiled grammars are cached in.
+	FString CacheDirectory;
+
+	// Hash of the rules that are compiled, if any are.
+	uint64 CompiledHash = 0;
+	bool bHasCompiled = false;
+	// *** //
+
+	// Returns the symbol for a char, adding it to the alphabet if it hasn't been seen yet. Returns -1 if the alphabet is full.
+	int32 AddSymbol(TCHAR c);
+
+	// Normalizes the probabilities of a group and builds its alias table.
+	void BuildAliasTable(LProductionGroup& group);
+
+	// Builds the automaton that finds every pattern, from the symbols of each pattern.
+	void BuildAutomaton(const TArray<TArray<uint8>>& patternSymbols);
+
+	// Finds the pattern that replaces each symbol, if there is one, in a single pass over the symbols. Works on both symbols and modules.
+	template <typename SymbolType>
+	void FindMatches(const SymbolType* symbols, int32 num);
+
+	// Rewriting is split into chunks of symbols. Each chunk has its own random stream, so the result doesn't depend on which core rewrote it.
+	// *** //
+	// Number of cores to spread the chunks over.
+	int32 GetNumWorkers(int32 numChunks) const;
+
+	// Runs a function for every chunk, in parallel when there is more than one worker.
+	void ForEachChunk(int32 numChunks, TFunctionRef<void(int32)> function) const;
+
+	// Selects the production of each symbol in a chunk. Returns the length of the chunk's output.
+	int64 SelectChunk(int32 chunk, int32 iteration);
+
+	// Writes the selected productions of a chunk into the output, starting at the offset.
+	void WriteChunk(int32 chunk, int32 offset);
+
+	// Second pass of the last iteration when packing. Words shared with the chunks either side are stored as the chunk's head and tail words, and combined once every chunk is written.
+	void WritePackedChunk(int32 chunk, int32 offset);
+
+	// Writes the last iteration packed, then frees the byte buffers.
+	void WritePacked(int32 numChunks, int64 outputLength);
+
+	// The same passes for the built-in rules, which only replace F and don't need the production tables to write.
+	int64 SelectBuiltinChunk(int32 chunk, int32 iteration);
+	void WriteBuiltinChunk(int32 chunk, int32 offset);
+	// *** //
+
+	// Checks whether the compiled grammar is the built-in rules, whatever their probabilities.
+	void DetectBuiltin();
+
+	// Whether the compiled grammar is the built-in rules.
+	bool bIsBuiltin = false;
+
+	// Budget for the size of the result.
+	// *** //
+	// The most symbols an iteration can output, from the symbol and memory limits. Each input symbol takes inputBytes while rewriting, and each output symbol outputBytes.
+	int64 GetSymbolCap(int32 num, int64 inputBytes, int64 outputBytes) const;
+
+	// Returns the number of symbols the production selected at a symbol outputs, and sets the number of symbols it replaces, which is more than one for patterns.
+	template <typename SymbolType>
+	int32 GetReplacementLength(const SymbolType* symbols, int32 num, int32 j, int32& replaced) const;
+
+	// Keeps some of the selected productions that grow the string unchanged, so the output fits in the cap. The kept symbols are spread evenly over the string. Returns the new output length, and sets the chunk offsets to match.
+	template <typename SymbolType>
+	int64 TrimChoices(const SymbolType* symbols, int32 num, int64 cap);
+
+	// Limits on the number of symbols and the bytes used while rewriting, 0 for no limit.
+	int64 MaxSymbols = 0;
+	int64 MaxBytes = 0;
+
+	// Whether the last iterations stopped early.
+	bool bIsTruncated = false;
+	// *** //
+
+	// The symbols to be iterated through.
+	TArray<uint8> Symbols;
+
+	// Each iteration writes into this buffer, which is then swapped with the symbols.
+	TArray<uint8> NextSymbols;
+
+	// The production chosen for each symbol in the current iteration, as an index into the symbol's group.
+	TArray<uint8> Choices;
+
+	// Choice used for symbols that are left unchanged. This also limits a group to 255 productions.
+	static constexpr uint8 KeepSymbol = MAX_uint8;
+
+	// The number of symbols in each chunk.
+	static constexpr int32 ChunkSize = 16384;
+
+	// The position of each chunk in the output, plus the total length at the end.
+	TArray<int64> ChunkOffsets;
+
+	// Packed output of the last iteration.
+	// *** //
+	bool bPackSymbols = false;
+	bool bIsPacked = false;
+	LPackedSymbols PackedSymbols;
+
+	// The partly written words at the start and end of each chunk's output.
+	TArray<uint64> ChunkHeadWords;
+	TArray<uint64> ChunkTailWords;
+	// *** //
+
+	// Seed for the random streams of each chunk.
+	int32 Seed = 0;
+
+	// Maximum number of cores to rewrite with, 0 for no limit.
+	int32 MaxWorkers = 0;
+
+	// Symbols rewritten since the rules were set.
+	int64 SymbolsRewritten = 0;
 
 	// An array to store the rules.
 	TArray<LRule> RulesArray;
 
-	// Combined probability values of the rules array.
-	float TotalProbability;
+	// The compiled grammar.
+	// *** //
+	// The alphabet. A symbol is an index into this array.
+	TArray<TCHAR> Alphabet;
+
+	// The axiom as symbols.
+	TArray<uint8> Axiom;
+
+	// The productions for each symbol, indexed by symbol.
+	TArray<LProductionGroup> Groups;
+
+	// Every production, grouped by the symbol they replace.
+	TArray<LProduction> Productions;
+
+	// The successor symbols of every production.
+	TArray<uint8> Successors;
+	// *** //
+
+	// Rules with more than one symbol or with context. Their groups come after the groups of each symbol.
+	// *** //
+	// The patterns, in order of priority. Where patterns overlap, the one that starts first is used, then the one that replaces the most symbols, then the one with the most context.
+	TArray<LPattern> Patterns;
+
+	// Aho-Corasick automaton over the patterns. Each state has a transition for every symbol, so each symbol of the string takes a single lookup.
+	TArray<int32> Transitions;
+
+	// The patterns that end at each state, stored from OutputOffsets[state] to OutputOffsets[state + 1] in Outputs.
+	TArray<int32> OutputOffsets;
+	TArray<int32> Outputs;
+
+	// The next state down the failure links that ends a pattern, or -1 if there isn't one.
+	TArray<int32> DictionaryLinks;
+
+	// The group that replaces each symbol of the current iteration, or -1 if it is replaced by its own group.
+	TArray<int32> Matches;
+
+	// Match for symbols that were replaced along with the symbol before them.
+	static constexpr int32 MatchConsumed = -2;
+	// *** //
+
+	// The compiled parametric grammar.
+	// *** //
+	// Whether the axiom or any rule has parameters.
+	bool bIsParametric = false;
+
+	// The expression for each parameter of each successor symbol, stored as LParam_Count expressions per symbol.
+	TArray<LParamExpression> SuccessorParams;
+
+	// The number of branches open before each successor symbol, counted from the start of its production.
+	TArray<uint8> SuccessorDepths;
+
+	// The axiom as modules.
+	TArray<LModule> AxiomModules;
+
+	// The modules to be iterated through, and the buffer each iteration writes into.
+	TArray<LModule> Modules;
+	TArray<LModule> NextModules;
+	// *** //
 };
@@ -0,0 +1,126 @@
+#include "LGrammarBuilder.h"
+#include "Hash/CityHash.h"
+
+LGrammarBuilder::LGrammarBuilder()
+{
+}
+
+LGrammarBuilder::~LGrammarBuilder()
+{
+}
+
+void LGrammarBuilder::Reset()
+{
+	Axiom.Reset();
+	Text.Reset();
+	Rules.Reset();
+}
+
+void LGrammarBuilder::SetAxiom(FStringView axiom)
+{
+	Axiom.Reset();
+	Axiom.Append(axiom.GetData(), axiom.Len());
+}
+
+// Rules are checked as they are added, so a grammar never has to skip a rule while it is compiled.
+bool LGrammarBuilder::AddRule(FStringView predecessor, FStringView successor, float weight)
+{
+	predecessor = predecessor.TrimStartAndEnd();
+	successor = successor.TrimStartAndEnd();
+
+	if (predecessor.IsEmpty() || !(weight >= 0.0f) || !FMath::IsFinite(weight))
+	{
+		UE_LOG(LogTemp, Warning, TEXT("LGrammarBuilder: ignoring rule '%s' with weight %f."), *FString(predecessor), weight);
+		return false;
+	}
+
+	LBuilderRule& rule = Rules.AddDefaulted_GetRef();
+	rule.PredecessorOffset = Text.Num();
+	rule.PredecessorLength = predecessor.Len();
+	Text.Append(predecessor.GetData(), predecessor.Len());
+
+	rule.SuccessorOffset = Text.Num();
+	rule.SuccessorLength = successor.Len();
+	Text.Append(successor.GetData(), successor.Len());
+
+	rule.Weight = weight;
+	return true;
+}
+
+// To the left of " => " is the predecessor. Between " => " and the last " (" is the successor, and the weight is between that and the last ")".
+bool LGrammarBuilder::AddRuleString(const FString& rule)
+{
+	const int32 separator = rule.Find(TEXT(" => "));
+	const int32 weightStart = rule.Find(TEXT(" ("), ESearchCase::CaseSensitive, ESearchDir::FromEnd);
+	const int32 weightEnd = rule.Find(TEXT(")"), ESearchCase::CaseSensitive, ESearchDir::FromEnd);
+
+	if (separator == INDEX_NONE || weightStart < separator + 4 || weightEnd < weightStart)
+	{
+		return false;
+	}
+
+	const FStringView view(rule);
+	const FStringView weight = view.Mid(weightStart + 2, weightEnd - weightStart - 2); // 2 is length of " ("
+
+	return AddRule(view.Mid(0, separator), view.Mid(separator + 4, weightStart - separator - 4), FCString::Atof(*FString(weight))); // 4 is length of " => "
+}
+
+// Rules are compared by their predecessor text. Only the first rule of each predecessor does the work, so each group is normalized once.
+void LGrammarBuilder::Normalize()
+{
+	for (int32 first = 0; first < Rules.Num(); first++)
+	{
+		const FStringView predecessor = GetPredecessor(first);
+
+		bool bIsFirst = true;
+		for (int32 r = 0; r < first && bIsFirst; r++)
+		{
+			bIsFirst = !GetPredecessor(r).Equals(predecessor, ESearchCase::CaseSensitive);
+		}
+
+		if (!bIsFirst)
+		{
+			continue;
+		}
+
+		double total = 0.0;
+		for (int32 r = first; r < Rules.Num(); r++)
+		{
+			if (GetPredecessor(r).Equals(predecessor, ESearchCase::CaseSensitive))
+			{
+				total += Rules[r].Weight;
+			}
+		}
+
+		if (total <= 0.0)
+		{
+			continue;
+		}
+
+		for (int32 r = first; r < Rules.Num(); r++)
+		{
+			if (GetPredecessor(r).Equals(predecessor, ESearchCase::CaseSensitive))
+			{
+				Rules[r].Weight = (float)(Rules[r].Weight / total);
+			}
+		}
+	}
+}
+
+// Hashes the axiom, then each rule's predecessor, successor and weight in turn. The number of rules is included so that moving text between rules changes the hash.
+uint64 LGrammarBuilder::GetHash() const
+{
+	uint64 hash = CityHash64WithSeed((const char*)Axiom.GetData(), Axiom.Num() * sizeof(TCHAR), (uint64)Rules.Num());
+
+	for (int32 r = 0; r < Rules.Num(); r++)
+	{
+		const FStringView predecessor = GetPredecessor(r);
+		const FStringView successor = GetSuccessor(r);
+
+		hash = CityHash64WithSeed((const char*)predecessor.GetData(), predecessor.Len() * sizeof(TCHAR), hash ^ (uint64)predecessor.Len());
+		hash = CityHash64WithSeed((const char*)successor.GetData(), successor.Len() * sizeof(TCHAR), hash ^ (uint64)successor.Len());
+		hash = CityHash64WithSeed((const char*)&Rules[r].Weight, sizeof(float), hash);
+	}
+
+	return hash;
+}
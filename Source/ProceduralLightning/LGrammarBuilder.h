@@ -0,0 +1,66 @@
+// Typed rules for a grammar. Each rule is given as its predecessor, successor and weight, rather than as a string like "F => F[+F] (0.4)", so weights are stored exactly and nothing is formatted and parsed back.
+// All of the text is kept in two buffers that keep their memory when the builder is reset, so rebuilding the same rules doesn't allocate.
+
+#pragma once
+
+#include "CoreMinimal.h"
+
+// A rule in the builder. Its predecessor and successor are ranges of the builder's text.
+struct LBuilderRule
+{
+	int32 PredecessorOffset;
+	int32 PredecessorLength;
+	int32 SuccessorOffset;
+	int32 SuccessorLength;
+
+	// The weight of the rule, as it was added. Normalize() scales it to a probability within the rules that replace the same predecessor.
+	float Weight;
+};
+
+/**
+ * 
+ */
+class PROCEDURALLIGHTNING_API LGrammarBuilder
+{
+public:
+	// Constructor and destructor.
+	LGrammarBuilder();
+	~LGrammarBuilder();
+
+	// Removes the axiom and rules, keeping their memory.
+	void Reset();
+
+	// Sets the starting symbols.
+	void SetAxiom(FStringView axiom);
+
+	// Adds a rule that replaces the predecessor with the successor. The predecessor can be more than one symbol, and can have context such as "A<F>B".
+	// Rules with nothing to replace, or a weight that is negative or not a number, are ignored. Returns whether the rule was added.
+	bool AddRule(FStringView predecessor, FStringView successor, float weight);
+
+	// Adds a rule written as a string, such as "F => F[+F] (0.4)". Returns whether the string was a valid rule.
+	bool AddRuleString(const FString& rule);
+
+	// Scales the weights of the rules that replace each predecessor so they add up to 1. Rules whose weights add up to 0 are left as they are.
+	void Normalize();
+
+	// Access to the axiom and rules.
+	// *** //
+	FStringView GetAxiom() const { return FStringView(Axiom.GetData(), Axiom.Num()); };
+	int32 Num() const { return Rules.Num(); };
+	FStringView GetPredecessor(int32 rule) const { return FStringView(Text.GetData() + Rules[rule].PredecessorOffset, Rules[rule].PredecessorLength); };
+	FStringView GetSuccessor(int32 rule) const { return FStringView(Text.GetData() + Rules[rule].SuccessorOffset, Rules[rule].SuccessorLength); };
+	float GetWeight(int32 rule) const { return Rules[rule].Weight; };
+	// *** //
+
+	// Returns a hash of the axiom and rules, including the exact bits of each weight. This identifies their compiled grammar.
+	uint64 GetHash() const;
+
+private:
+	// The axiom's chars.
+	TArray<TCHAR> Axiom;
+
+	// The chars of every predecessor and successor, one after the other.
+	TArray<TCHAR> Text;
+
+	TArray<LBuilderRule> Rules;
+};
@@ -0,0 +1,29 @@
+#include "LPackedSymbols.h"
+
+LPackedSymbols::LPackedSymbols()
+{
+}
+
+LPackedSymbols::~LPackedSymbols()
+{
+}
+
+// The words are allocated without slack, as packed symbols are only used for long strings. Memory is only reallocated when there isn't enough.
+void LPackedSymbols::SetNumUninitialized(int32 num)
+{
+	const int32 numWords = FMath::DivideAndRoundUp(num, SymbolsPerWord);
+
+	if (Words.Max() < numWords)
+	{
+		Words.Empty(numWords);
+	}
+
+	Words.SetNumUninitialized(numWords, false);
+	NumSymbols = num;
+}
+
+void LPackedSymbols::Empty()
+{
+	Words.Empty();
+	NumSymbols = 0;
+}
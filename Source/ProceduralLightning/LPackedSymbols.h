@@ -0,0 +1,69 @@
+// Symbols packed into 3 bits each, for grammars with an alphabet of 8 symbols or fewer, such as the lightning symbols.
+// 21 symbols are stored in each 64-bit word, so no symbol crosses from one word into the next and any symbol can be read with a shift and a mask. This takes 3/8 of the memory of a byte per symbol.
+
+#pragma once
+
+#include "CoreMinimal.h"
+
+/**
+ * 
+ */
+class PROCEDURALLIGHTNING_API LPackedSymbols
+{
+public:
+	// Constructor and destructor.
+	LPackedSymbols();
+	~LPackedSymbols();
+
+	static constexpr int32 BitsPerSymbol = 3;
+	static constexpr int32 SymbolsPerWord = 21;
+	static constexpr uint64 SymbolMask = (1 << BitsPerSymbol) - 1;
+
+	// The largest alphabet that can be packed.
+	static constexpr int32 MaxAlphabetSize = 1 << BitsPerSymbol;
+
+	// The lowest bit of each symbol in a word.
+	static constexpr uint64 LaneMask = 0x1249249249249249ull;
+
+	int32 Num() const { return NumSymbols; };
+
+	uint8 operator[](int32 index) const
+	{
+		return (uint8)((Words[index / SymbolsPerWord] >> ((index % SymbolsPerWord) * BitsPerSymbol)) & SymbolMask);
+	};
+
+	// Sets the number of symbols without initializing them. The words are allocated to exactly fit.
+	void SetNumUninitialized(int32 num);
+
+	// Removes every symbol and frees the words.
+	void Empty();
+
+	// Access to the words, for reading and writing many symbols at once.
+	// *** //
+	int32 NumWords() const { return Words.Num(); };
+	const uint64* GetWords() const { return Words.GetData(); };
+	uint64* GetWords() { return Words.GetData(); };
+	// *** //
+
+	// Returns the lowest bit of each symbol in a word that is equal to the symbol. Every symbol in the word is compared at once.
+	static uint64 MatchLanes(uint64 word, uint8 symbol)
+	{
+		// Symbols that are equal become 0. Each symbol's bits are then folded into its lowest bit, which is only clear if all of them were.
+		const uint64 difference = word ^ (LaneMask * symbol);
+		return ~(difference | (difference >> 1) | (difference >> 2)) & LaneMask;
+	};
+
+	// Returns the lowest bit of each symbol in a word that holds a symbol, as the last word can be partly empty.
+	uint64 GetValidLanes(int32 word) const
+	{
+		const int32 count = FMath::Min(NumSymbols - word * SymbolsPerWord, SymbolsPerWord);
+		return count == SymbolsPerWord ? LaneMask : LaneMask & ((1ull << (count * BitsPerSymbol)) - 1);
+	};
+
+	// Bytes used by the words.
+	SIZE_T GetAllocatedSize() const { return Words.GetAllocatedSize(); };
+
+private:
+	TArray<uint64> Words;
+	int32 NumSymbols = 0;
+};
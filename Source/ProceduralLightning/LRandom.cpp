@@ -0,0 +1,250 @@
+#include "LRandom.h"
+
+// Random blocks use SSE2 on x86 and NEON on ARM, or plain C++ on anything else.
+#if defined(PLATFORM_ENABLE_VECTORINTRINSICS_NEON) && PLATFORM_ENABLE_VECTORINTRINSICS_NEON
+#include <arm_neon.h>
+#define LRANDOM_USE_SSE 0
+#define LRANDOM_USE_NEON 1
+#elif defined(PLATFORM_CPU_X86_FAMILY) && PLATFORM_CPU_X86_FAMILY && PLATFORM_ENABLE_VECTORINTRINSICS
+#include <emmintrin.h>
+#define LRANDOM_USE_SSE 1
+#define LRANDOM_USE_NEON 0
+#else
+#define LRANDOM_USE_SSE 0
+#define LRANDOM_USE_NEON 0
+#endif
+
+// SplitMix64 steps. These are used to spread a seed over the generator's state, and on their own as a counter-based generator.
+// *** //
+static uint64 Mix64(uint64 z)
+{
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+	return z ^ (z >> 31);
+}
+
+static uint64 SplitMix64(uint64& state)
+{
+	state += 0x9E3779B97F4A7C15ull;
+	return Mix64(state);
+}
+// *** //
+
+LRandom::LRandom()
+{
+	Seed(0);
+}
+
+LRandom::LRandom(uint64 seed, uint64 stream)
+{
+	Seed(seed, stream);
+}
+
+LRandom::~LRandom()
+{
+}
+
+// Fills the state from the seed and stream. The stream is mixed before being added, so streams that are close together still start far apart.
+void LRandom::Seed(uint64 seed, uint64 stream)
+{
+	uint64 state = seed + Mix64(stream + 0x9E3779B97F4A7C15ull);
+
+	const uint64 a = SplitMix64(state);
+	const uint64 b = SplitMix64(state);
+
+	State[0] = (uint32)a;
+	State[1] = (uint32)(a >> 32);
+	State[2] = (uint32)b;
+	State[3] = (uint32)(b >> 32);
+
+	// The generator never leaves an all zero state, so make sure it doesn't start in one.
+	if ((State[0] | State[1] | State[2] | State[3]) == 0)
+	{
+		State[0] = 1;
+	}
+
+	bHasSpareGaussian = false;
+	SpareGaussian = 0;
+}
+
+// Normally distributed random float, using the Box-Muller transform.
+float LRandom::Gaussian(float mean, float deviation)
+{
+	if (bHasSpareGaussian)
+	{
+		bHasSpareGaussian = false;
+		return mean + deviation * SpareGaussian;
+	}
+
+	// 1 - FRand is never 0, so the log is always valid.
+	const float radius = FMath::Sqrt(-2.0f * FMath::Loge(1.0f - FRand()));
+	float sine, cosine;
+	FMath::SinCos(&sine, &cosine, 2.0f * PI * FRand());
+
+	SpareGaussian = radius * sine;
+	bHasSpareGaussian = true;
+
+	return mean + deviation * radius * cosine;
+}
+
+// Counter-based random number. The counter is spaced out by the golden ratio, as SplitMix64 does, then mixed with the seed and stream.
+uint64 LRandom::Hash(uint64 seed, uint64 stream, uint64 counter)
+{
+	return Mix64(seed + Mix64(stream + 0x9E3779B97F4A7C15ull) + (counter + 1) * 0x9E3779B97F4A7C15ull);
+}
+
+LRandomBlock::LRandomBlock()
+{
+	Seed(0);
+}
+
+LRandomBlock::LRandomBlock(uint64 seed, uint64 stream)
+{
+	Seed(seed, stream);
+}
+
+LRandomBlock::~LRandomBlock()
+{
+}
+
+// Fills every lane's state from the seed and stream, in the same way as LRandom.
+void LRandomBlock::Seed(uint64 seed, uint64 stream)
+{
+	uint64 state = seed + Mix64(stream + 0x9E3779B97F4A7C15ull);
+
+	for (int32 lane = 0; lane < Lanes; lane++)
+	{
+		const uint64 a = SplitMix64(state);
+		const uint64 b = SplitMix64(state);
+
+		State[0][lane] = (uint32)a;
+		State[1][lane] = (uint32)(a >> 32);
+		State[2][lane] = (uint32)b;
+		State[3][lane] = (uint32)(b >> 32);
+
+		if ((State[0][lane] | State[1][lane] | State[2][lane] | State[3][lane]) == 0)
+		{
+			State[0][lane] = 1;
+		}
+	}
+
+	// Empty blocks are filled when a number is first taken from them.
+	UniformPosition = BlockSize;
+	GaussianPosition = BlockSize;
+}
+
+// Steps every lane once without SIMD. This gives the same numbers as the SIMD version.
+void LRandomBlock::NextLanes(uint32* values)
+{
+	for (int32 lane = 0; lane < Lanes; lane++)
+	{
+		const uint32 t = State[1][lane] << 9;
+
+		values[lane] = State[0][lane] + State[3][lane];
+
+		State[2][lane] ^= State[0][lane];
+		State[3][lane] ^= State[1][lane];
+		State[1][lane] ^= State[2][lane];
+		State[0][lane] ^= State[3][lane];
+		State[2][lane] ^= t;
+		State[3][lane] = (State[3][lane] << 11) | (State[3][lane] >> 21);
+	}
+}
+
+// Fills an array with uniform floats, one from each lane at a time. The top 24 bits of each number are turned into a float from 0 to 1.
+void LRandomBlock::FillUniform(float* values, int32 count)
+{
+	const float scale = 1.0f / 16777216.0f;
+	int32 i = 0;
+
+#if LRANDOM_USE_SSE
+	__m128i s0 = _mm_load_si128((const __m128i*)State[0]);
+	__m128i s1 = _mm_load_si128((const __m128i*)State[1]);
+	__m128i s2 = _mm_load_si128((const __m128i*)State[2]);
+	__m128i s3 = _mm_load_si128((const __m128i*)State[3]);
+	const __m128 scales = _mm_set1_ps(scale);
+
+	for (; i + Lanes <= count; i += Lanes)
+	{
+		const __m128i result = _mm_add_epi32(s0, s3);
+		const __m128i t = _mm_slli_epi32(s1, 9);
+
+		s2 = _mm_xor_si128(s2, s0);
+		s3 = _mm_xor_si128(s3, s1);
+		s1 = _mm_xor_si128(s1, s2);
+		s0 = _mm_xor_si128(s0, s3);
+		s2 = _mm_xor_si128(s2, t);
+		s3 = _mm_or_si128(_mm_slli_epi32(s3, 11), _mm_srli_epi32(s3, 21));
+
+		_mm_storeu_ps(values + i, _mm_mul_ps(_mm_cvtepi32_ps(_mm_srli_epi32(result, 8)), scales));
+	}
+
+	_mm_store_si128((__m128i*)State[0], s0);
+	_mm_store_si128((__m128i*)State[1], s1);
+	_mm_store_si128((__m128i*)State[2], s2);
+	_mm_store_si128((__m128i*)State[3], s3);
+#elif LRANDOM_USE_NEON
+	uint32x4_t s0 = vld1q_u32(State[0]);
+	uint32x4_t s1 = vld1q_u32(State[1]);
+	uint32x4_t s2 = vld1q_u32(State[2]);
+	uint32x4_t s3 = vld1q_u32(State[3]);
+
+	for (; i + Lanes <= count; i += Lanes)
+	{
+		const uint32x4_t result = vaddq_u32(s0, s3);
+		const uint32x4_t t = vshlq_n_u32(s1, 9);
+
+		s2 = veorq_u32(s2, s0);
+		s3 = veorq_u32(s3, s1);
+		s1 = veorq_u32(s1, s2);
+		s0 = veorq_u32(s0, s3);
+		s2 = veorq_u32(s2, t);
+		s3 = vorrq_u32(vshlq_n_u32(s3, 11), vshrq_n_u32(s3, 21));
+
+		vst1q_f32(values + i, vmulq_n_f32(vcvtq_f32_u32(vshrq_n_u32(result, 8)), scale));
+	}
+
+	vst1q_u32(State[0], s0);
+	vst1q_u32(State[1], s1);
+	vst1q_u32(State[2], s2);
+	vst1q_u32(State[3], s3);
+#endif
+
+	// Whatever is left, or everything on platforms without SIMD.
+	uint32 lanes[Lanes];
+	while (i < count)
+	{
+		NextLanes(lanes);
+
+		for (int32 lane = 0; lane < Lanes && i < count; lane++, i++)
+		{
+			values[i] = (lanes[lane] >> 8) * scale;
+		}
+	}
+}
+
+// Fills an array with normally distributed floats. Each pair of uniform numbers is turned into a pair of normally distributed numbers using the Box-Muller transform.
+void LRandomBlock::FillGaussian(float* values, int32 count)
+{
+	const int32 pairs = count / 2;
+	FillUniform(values, pairs * 2);
+
+	for (int32 i = 0; i < pairs * 2; i += 2)
+	{
+		// 1 - u is never 0, so the log is always valid.
+		const float radius = FMath::Sqrt(-2.0f * FMath::Loge(1.0f - values[i]));
+		float sine, cosine;
+		FMath::SinCos(&sine, &cosine, 2.0f * PI * values[i + 1]);
+
+		values[i] = radius * cosine;
+		values[i + 1] = radius * sine;
+	}
+
+	// An odd count needs one more number, from a pair of its own.
+	if (count % 2 == 1)
+	{
+		float pair[2];
+		FillGaussian(pair, 2);
+		values[count - 1] = pair[0];
+	}
+}
@@ -0,0 +1,157 @@
+// Seedable random number generator, used in place of the global FMath random functions so that lightning can be reproduced from a seed and generated on more than one thread.
+// Each generator is a xoshiro128** generator with its state filled by SplitMix64 from a seed and a stream ID. Generators with the same seed but different streams give independent sequences.
+
+#pragma once
+
+#include "CoreMinimal.h"
+
+// Stream IDs, so that each part of the lightning generation draws from its own sequence when given the same seed.
+enum ELRandomStream : uint64
+{
+	LRandomStream_Grammar = 1,
+	LRandomStream_Physics = 2,
+	LRandomStream_Turtle = 3,
+	LRandomStream_Expander = 4,
+	LRandomStream_Derivation = 5,
+};
+
+/**
+ * 
+ */
+class PROCEDURALLIGHTNING_API LRandom
+{
+public:
+	// Constructors and destructor.
+	LRandom();
+	LRandom(uint64 seed, uint64 stream = 0);
+	~LRandom();
+
+	// Resets the generator to the start of a seed's stream.
+	void Seed(uint64 seed, uint64 stream = 0);
+
+	// Returns the next 32 random bits.
+	uint32 NextUInt32()
+	{
+		const uint32 result = Rotl(State[1] * 5, 7) * 9;
+		const uint32 t = State[1] << 9;
+
+		State[2] ^= State[0];
+		State[3] ^= State[1];
+		State[1] ^= State[2];
+		State[0] ^= State[3];
+		State[2] ^= t;
+		State[3] = Rotl(State[3], 11);
+
+		return result;
+	};
+
+	// Random float from 0 up to but not including 1. Uses the top 24 bits, which is all a float can hold in that range.
+	float FRand() { return (NextUInt32() >> 8) * (1.0f / 16777216.0f); };
+
+	// Random float in a range.
+	float FRandRange(float low, float high) { return low + (high - low) * FRand(); };
+
+	// Random integer in a range, including both ends.
+	int32 RandRange(int32 low, int32 high) { return low + (int32)(((uint64)NextUInt32() * (uint64)((int64)high - low + 1)) >> 32); };
+
+	// Random boolean with equal chance of each.
+	bool RandBool() { return (NextUInt32() >> 31) != 0; };
+
+	// Normally distributed random float.
+	float Gaussian(float mean, float deviation);
+
+	// Counter-based random numbers. These mix the seed, stream and counter straight into a random number without any state, so any number in a stream can be found without finding the ones before it.
+	// *** //
+	static uint64 Hash(uint64 seed, uint64 stream, uint64 counter);
+	static float HashFraction(uint64 seed, uint64 stream, uint64 counter) { return (Hash(seed, stream, counter) >> 40) * (1.0f / 16777216.0f); };
+	// *** //
+
+	// Allows the generator to be used with the standard library's distributions.
+	// *** //
+	using result_type = uint32;
+	static constexpr result_type min() { return 0; };
+	static constexpr result_type max() { return MAX_uint32; };
+	result_type operator()() { return NextUInt32(); };
+	// *** //
+
+private:
+	static uint32 Rotl(uint32 x, int k) { return (x << k) | (x >> (32 - k)); };
+
+	// The generator's state.
+	uint32 State[4];
+
+	// Box-Muller makes normally distributed numbers in pairs, so the second one is saved for the next call.
+	float SpareGaussian;
+	bool bHasSpareGaussian;
+};
+
+// Generates random numbers in blocks. This runs four xoshiro128+ generators side by side in SIMD lanes, so a block of uniform numbers takes a few vector instructions per four numbers. Normally distributed numbers are made from the uniform block with the Box-Muller transform.
+// Numbers are taken from the blocks one at a time, and a block is only refilled once it has been used up.
+class PROCEDURALLIGHTNING_API LRandomBlock
+{
+public:
+	// Constructors and destructor.
+	LRandomBlock();
+	LRandomBlock(uint64 seed, uint64 stream = 0);
+	~LRandomBlock();
+
+	// Resets the generator to the start of a seed's stream, and empties the blocks.
+	void Seed(uint64 seed, uint64 stream = 0);
+
+	// Fills an array with random floats from 0 up to but not including 1.
+	void FillUniform(float* values, int32 count);
+
+	// Fills an array with normally distributed random floats, with a mean of 0 and deviation of 1.
+	void FillGaussian(float* values, int32 count);
+
+	// Takes the next random float from 0 up to but not including 1 from the uniform block.
+	float FRand()
+	{
+		if (UniformPosition == BlockSize)
+		{
+			FillUniform(Uniforms, BlockSize);
+			UniformPosition = 0;
+		}
+
+		return Uniforms[UniformPosition++];
+	};
+
+	// Random float in a range.
+	float FRandRange(float low, float high) { return low + (high - low) * FRand(); };
+
+	// Random boolean with equal chance of each.
+	bool RandBool() { return FRand() < 0.5f; };
+
+	// Takes the next normally distributed random float from the gaussian block.
+	float Gaussian(float mean, float deviation)
+	{
+		if (GaussianPosition == BlockSize)
+		{
+			FillGaussian(Gaussians, BlockSize);
+			GaussianPosition = 0;
+		}
+
+		return mean + deviation * Gaussians[GaussianPosition++];
+	};
+
+	// The number of random numbers in each block.
+	static constexpr int32 BlockSize = 256;
+
+	// The number of generators running side by side.
+	static constexpr int32 Lanes = 4;
+
+private:
+	// Generates one random uint32 for each lane, for when fewer numbers than lanes are needed.
+	void NextLanes(uint32* values);
+
+	// State of each generator, stored by state word then lane so that each word of every lane can be loaded at once.
+	alignas(16) uint32 State[4][Lanes];
+
+	// The blocks, and the position of the next number to take from each.
+	// *** //
+	alignas(16) float Uniforms[BlockSize];
+	alignas(16) float Gaussians[BlockSize];
+	int32 UniformPosition;
+	int32 GaussianPosition;
+	// *** //
+};
@@ -0,0 +1,36 @@
+#include "LRotationTable.h"
+
+LRotationTable::LRotationTable()
+{
+	// An empty range that Build will always replace.
+	MinAngle = MAX_flt;
+	MaxAngle = -MAX_flt;
+
+	for (int32 i = 0; i < NumSteps; i++)
+	{
+		Sines[i] = 0.0f;
+		Cosines[i] = 1.0f;
+	}
+}
+
+LRotationTable::~LRotationTable()
+{
+}
+
+// Each step covers an equal part of the range, and uses the angle at its middle so the steps are centred on the range.
+void LRotationTable::Build(float minAngle, float maxAngle)
+{
+	if (minAngle == MinAngle && maxAngle == MaxAngle)
+	{
+		return;
+	}
+
+	MinAngle = minAngle;
+	MaxAngle = maxAngle;
+
+	for (int32 i = 0; i < NumSteps; i++)
+	{
+		const float angle = FMath::Lerp(minAngle, maxAngle, (i + 0.5f) / NumSteps);
+		FMath::SinCos(&Sines[i], &Cosines[i], FMath::DegreesToRadians(angle));
+	}
+}
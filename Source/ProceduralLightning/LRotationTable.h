@@ -0,0 +1,55 @@
+// Precomputed turtle turns. Turn angles are quantized to a fixed number of steps between their min and max, and the sine and cosine of every step is stored, so turning a direction takes a few multiplies rather than building an FRotator and its sines and cosines.
+
+#pragma once
+
+#include "CoreMinimal.h"
+
+/**
+ * 
+ */
+class PROCEDURALLIGHTNING_API LRotationTable
+{
+public:
+	// Constructor and destructor.
+	LRotationTable();
+	~LRotationTable();
+
+	// The number of angles between the min and max angle. Steps are picked with 8 random bits.
+	static constexpr int32 NumSteps = 256;
+
+	// Fills the table for angles between min and max, in degrees. The table is only rebuilt if the range has changed.
+	void Build(float minAngle, float maxAngle);
+
+	// Rotates a direction in the same way as FRotator(sign * pitch, yaw, 0).RotateVector, where pitch and yaw are the angles of their steps and the yaw is negated if asked.
+	// Without 3D, only the pitch is applied.
+	void Rotate(FVector& direction, float sign, uint32 pitchStep, uint32 yawStep, bool bNegateYaw, bool b3D) const
+	{
+		const FVector::FReal sp = sign * Sines[pitchStep];
+		const FVector::FReal cp = Cosines[pitchStep];
+
+		// Pitch turns the direction in the XZ plane.
+		const FVector::FReal x = direction.X * cp - direction.Z * sp;
+		const FVector::FReal z = direction.X * sp + direction.Z * cp;
+
+		if (!b3D)
+		{
+			direction = FVector(x, direction.Y, z);
+			return;
+		}
+
+		// Yaw then turns it in the XY plane.
+		const FVector::FReal sy = bNegateYaw ? -Sines[yawStep] : Sines[yawStep];
+		const FVector::FReal cy = Cosines[yawStep];
+
+		direction = FVector(x * cy - direction.Y * sy, x * sy + direction.Y * cy, z);
+	};
+
+private:
+	// The range the table was built for.
+	float MinAngle;
+	float MaxAngle;
+
+	// Sine and cosine of the angle at the middle of each step.
+	float Sines[NumSteps];
+	float Cosines[NumSteps];
+};
@@ -0,0 +1,133 @@
+#include "LSegmentStream.h"
+
+LSegmentRing::LSegmentRing()
+{
+	Head.store(0);
+	Tail.store(0);
+}
+
+LSegmentRing::~LSegmentRing()
+{
+}
+
+// The segment is written before the head is moved past it, and the release makes sure the consumer sees it written.
+bool LSegmentRing::Push(const LStreamedSegment& segment)
+{
+	const uint32 head = Head.load(std::memory_order_relaxed);
+
+	if (head - Tail.load(std::memory_order_acquire) == Capacity)
+	{
+		return false;
+	}
+
+	Items[head & (Capacity - 1)] = segment;
+	Head.store(head + 1, std::memory_order_release);
+	return true;
+}
+
+// Every segment ready is copied out at once, then the tail is moved past them so the producer can reuse their slots.
+int32 LSegmentRing::Pop(LSegmentBuffer& segments, int32 maxSegments)
+{
+	const uint32 tail = Tail.load(std::memory_order_relaxed);
+	const int32 num = FMath::Min((int32)(Head.load(std::memory_order_acquire) - tail), maxSegments);
+
+	if (num <= 0)
+	{
+		return 0;
+	}
+
+	const int32 first = segments.AddUninitialized(num);
+
+	for (int32 i = 0; i < num; i++)
+	{
+		const LStreamedSegment& segment = Items[(tail + i) & (Capacity - 1)];
+		segments.Starts[first + i] = segment.Start;
+		segments.Ends[first + i] = segment.End;
+		segments.Directions[first + i] = segment.Direction;
+		segments.Widths[first + i] = segment.Width;
+		segments.Depths[first + i] = segment.Depth;
+	}
+
+	Tail.store(tail + num, std::memory_order_release);
+	return num;
+}
+
+void LSegmentRing::Reset()
+{
+	Head.store(0);
+	Tail.store(0);
+}
+
+LSegmentStream::LSegmentStream()
+{
+	bCancelled.store(false);
+	bFinished.store(true);
+	SpaceEvent = FPlatformProcess::GetSynchEventFromPool(false);
+}
+
+LSegmentStream::~LSegmentStream()
+{
+	FPlatformProcess::ReturnSynchEventToPool(SpaceEvent);
+}
+
+void LSegmentStream::Cancel()
+{
+	bCancelled.store(true, std::memory_order_relaxed);
+	SpaceEvent->Trigger();
+}
+
+// The event resets itself, so a trigger with no producer waiting lets its next wait return straight away. The producer then checks the ring again, so no drain is missed.
+int32 LSegmentStream::Drain(LSegmentBuffer& segments, int32 maxSegments)
+{
+	const int32 num = Ring.Pop(segments, maxSegments);
+
+	if (num > 0)
+	{
+		SpaceEvent->Trigger();
+	}
+
+	return num;
+}
+
+void LSegmentStream::Reset()
+{
+	Ring.Reset();
+	bCancelled.store(false);
+	bFinished.store(false);
+}
+
+// The same expansion and turtle as a streamed strike on the game thread, so the segments come out in the same order. The producer sleeps while the ring is full, as the game thread only drains it once a frame.
+void LSegmentStream::Produce(const LBoltRequest& request)
+{
+	SCOPE_CYCLE_COUNTER(STAT_ProduceSegments)
+	{
+		System.Prepare(request.Rules);
+		Expander.Begin(&System.GetGrammar(), request.Iterations, request.Seed);
+		Turtle.Begin(request.TurtleSettings, request.Seed);
+		Segments.Reset();
+
+		uint8 symbol;
+		while (!bCancelled.load(std::memory_order_relaxed) && Expander.Next(symbol))
+		{
+			if (!Turtle.Step(symbol, Segments))
+			{
+				continue;
+			}
+
+			const LStreamedSegment segment = { Segments.Starts[0], Segments.Ends[0], Segments.Directions[0], Segments.Widths[0], Segments.Depths[0] };
+			Segments.Reset();
+
+			while (!Ring.Push(segment))
+			{
+				if (bCancelled.load(std::memory_order_relaxed))
+				{
+					break;
+				}
+
+				SpaceEvent->Wait();
+			}
+		}
+
+		bFinished.store(true, std::memory_order_release);
+	}
+}
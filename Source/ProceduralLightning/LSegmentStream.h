@@ -0,0 +1,97 @@
+// Pipelined L-system lightning. A worker thread expands the string one symbol at a time and passes each segment the turtle draws through a ring buffer, and the game thread takes whatever segments are ready each frame.
+// The first segments can be drawn as soon as they are expanded, rather than once the whole string has been built and interpreted.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "LBoltBuilder.h"
+#include "LStreamExpander.h"
+#include <atomic>
+
+DECLARE_CYCLE_STAT(TEXT("Produce Segments"), STAT_ProduceSegments, STATGROUP_LSystem);
+
+// A segment passed from the worker thread to the game thread.
+struct LStreamedSegment
+{
+	FVector Start;
+	FVector End;
+	FVector Direction;
+	float Width;
+	uint8 Depth;
+};
+
+// Ring buffer of segments with a single producer and a single consumer. Each side only writes its own index, so neither needs a lock.
+class PROCEDURALLIGHTNING_API LSegmentRing
+{
+public:
+	// Constructor and destructor.
+	LSegmentRing();
+	~LSegmentRing();
+
+	// The number of segments the ring can hold. This is a power of 2 so an index is wrapped with a mask.
+	static constexpr uint32 Capacity = 8192;
+
+	// Adds a segment. Only called by the producer. Returns false if the ring is full.
+	bool Push(const LStreamedSegment& segment);
+
+	// Moves up to maxSegments segments onto the end of the buffer. Only called by the consumer. Returns the number moved.
+	int32 Pop(LSegmentBuffer& segments, int32 maxSegments);
+
+	// Empties the ring. Neither side can be using it.
+	void Reset();
+
+	bool IsEmpty() const { return Head.load(std::memory_order_acquire) == Tail.load(std::memory_order_acquire); };
+
+private:
+	LStreamedSegment Items[Capacity];
+
+	// The producer writes at the head and the consumer reads from the tail. They are kept on separate cache lines so each side's writes don't slow down the other.
+	alignas(PLATFORM_CACHE_LINE_SIZE) std::atomic<uint32> Head;
+	alignas(PLATFORM_CACHE_LINE_SIZE) std::atomic<uint32> Tail;
+};
+
+/**
+ * 
+ */
+class PROCEDURALLIGHTNING_API LSegmentStream
+{
+public:
+	// Constructor and destructor.
+	LSegmentStream();
+	~LSegmentStream();
+
+	// Expands and interprets the request's L system, pushing each segment into the ring. Runs on a worker thread until every segment has been pushed or it is cancelled. Sleeps while the ring is full, until segments are drained.
+	void Produce(const LBoltRequest& request);
+
+	// Sets the directory that compiled grammars are cached in. This must not be called while producing.
+	void SetCacheDirectory(const FString& directory) { System.SetCacheDirectory(directory); };
+
+	// Asks the producer to stop. It stops at its next segment, and is woken if it is waiting for space.
+	void Cancel();
+
+	// Gets the stream ready for the next producer. The last producer must have finished.
+	void Reset();
+
+	// Moves the segments that are ready onto the end of the buffer, up to maxSegments. Returns the number moved.
+	int32 Drain(LSegmentBuffer& segments, int32 maxSegments);
+
+	// Whether the producer has finished and every segment has been drained.
+	bool IsDone() const { return bFinished.load(std::memory_order_acquire) && Ring.IsEmpty(); };
+
+private:
+	// The producer's own L system, expander and turtle, so the game thread can change its own while the producer runs.
+	LSystem System;
+	LStreamExpander Expander;
+	LTurtle Turtle;
+
+	// The segment the turtle has just drawn.
+	LSegmentBuffer Segments;
+
+	LSegmentRing Ring;
+
+	// Signalled when segments are drained or the producer is cancelled, so a producer waiting on a full ring doesn't hold a worker thread spinning.
+	FEvent* SpaceEvent;
+
+	std::atomic<bool> bCancelled;
+	std::atomic<bool> bFinished;
+};
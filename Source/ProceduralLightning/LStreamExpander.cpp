@@ -0,0 +1,57 @@
+#include "LStreamExpander.h"
+
+LStreamExpander::LStreamExpander()
+{
+	Grammar = nullptr;
+	Iterations = 0;
+}
+
+LStreamExpander::~LStreamExpander()
+{
+}
+
+// Starts expanding from the grammar's axiom.
+void LStreamExpander::Begin(const LGrammar* grammar, int iterations, int32 seed)
+{
+	Grammar = grammar;
+	Iterations = iterations;
+	Random.Seed((uint32)seed, LRandomStream_Expander);
+
+	Stack.Reset(iterations + 1);
+
+	const TArray<uint8>& axiom = Grammar->GetAxiom();
+	Stack.Add({ axiom.GetData(), axiom.Num(), 0, 0 });
+}
+
+// Gets the next symbol of the final string. Symbols are rewritten as soon as they are reached, and their successor is expanded before moving on, so the symbols come out in the same order as the built string.
+bool LStreamExpander::Next(uint8& symbol)
+{
+	while (!Stack.IsEmpty())
+	{
+		Frame& frame = Stack.Last();
+
+		// When a successor has been fully expanded, go back up to the string that contained it.
+		if (frame.Position == frame.Num)
+		{
+			Stack.Pop(false);
+			continue;
+		}
+
+		const uint8 current = frame.Symbols[frame.Position++];
+		const int32 depth = frame.Depth;
+		const LProductionGroup& group = Grammar->GetGroups()[current];
+
+		// Symbols at the final depth are given out. Symbols without rules never change, so they can be given out straight away.
+		if (depth == Iterations || group.Num == 0)
+		{
+			symbol = current;
+			return true;
+		}
+
+		// Otherwise select a production and expand it next.
+		const LProduction& production = Grammar->GetProductions()[Grammar->SelectProduction(group, Random.FRand())];
+		Stack.Add({ Grammar->GetSuccessors().GetData() + production.Offset, production.Length, 0, depth + 1 });
+	}
+
+	return false;
+}
@@ -0,0 +1,48 @@
+// Streaming L system expander. Rather than building the whole string, this walks the derivation tree depth first and gives out the final symbols one at a time.
+// Only the path from the axiom to the current symbol is stored, so memory grows with the number of iterations rather than the length of the string.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "LGrammar.h"
+#include "LRandom.h"
+
+/**
+ * 
+ */
+class PROCEDURALLIGHTNING_API LStreamExpander
+{
+public:
+	// Constructor and destructor.
+	LStreamExpander();
+	~LStreamExpander();
+
+	// Starts expanding the grammar's axiom for the specified number of iterations. The grammar must not change while it is being expanded.
+	// Only rules for single symbols are used, as patterns need the symbols around them. Grammars with patterns should be built instead.
+	void Begin(const LGrammar* grammar, int iterations, int32 seed);
+
+	// Gets the next symbol of the final string. Returns false once every symbol has been given out.
+	bool Next(uint8& symbol);
+
+private:
+	// A string being expanded - either the axiom or a production's successor - and how far through it the expansion is.
+	struct Frame
+	{
+		const uint8* Symbols;
+		int32 Num;
+		int32 Position;
+		int32 Depth;
+	};
+
+	// The grammar being expanded.
+	const LGrammar* Grammar;
+
+	// The number of iterations. Symbols at this depth are final.
+	int Iterations;
+
+	// The path from the axiom to the current symbol. There is at most one frame per iteration, plus the axiom.
+	TArray<Frame> Stack;
+
+	// Random generator used to select productions.
+	LRandom Random;
+};
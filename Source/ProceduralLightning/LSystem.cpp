@@ -9,20 +9,47 @@ LSystem::~LSystem()
 }
 
 // Build the L system.
-void LSystem::Build(FString axiom, TArray<FString> rules, int iterations)
+void LSystem::Build(const LGrammarBuilder& rules, int iterations, int32 seed)
 {
-	// Create the L system's stochastic grammar using the provided rules and axiom.
-	LGrammar grammar(axiom, rules);
+	// Set up the L system's stochastic grammar using the provided rules and axiom.
+	Grammar.SetRules(rules);
 
-	// Iterate through the string the specified number of times.
-	grammar.Iterate(iterations);
+	// Set the seed used to select rules.
+	Grammar.SetSeed(seed);
 
-	// Save the result.
-	Result = grammar.GetResult();
+	// Iterate through the string the specified number of times. Parametric grammars rewrite modules rather than symbols.
+	if (Grammar.IsParametric())
+	{
+		Grammar.IterateParametric(iterations);
+	}
+	else
+	{
+		Grammar.Iterate(iterations);
+	}
 }
 
-// Returns the resulting string.
-FString LSystem::GetResult()
+// The rule strings are parsed into typed rules first.
+void LSystem::Build(const FString& axiom, const TArray<FString>& rules, int iterations, int32 seed)
 {
-	return Result;
+	LGrammarBuilder builder;
+	builder.SetAxiom(axiom);
+
+	for (const FString& rule : rules)
+	{
+		builder.AddRuleString(rule);
+	}
+
+	Build(builder, iterations, seed);
+}
+
+// Compiles the grammar. The result is left as the axiom.
+void LSystem::Prepare(const LGrammarBuilder& rules)
+{
+	Grammar.SetRules(rules);
+}
+
+// Returns the resulting string. The grammar's symbols are the only copy of the result, so the string is made when it is asked for.
+FString LSystem::GetResult() const
+{
+	return Grammar.GetResult();
 }
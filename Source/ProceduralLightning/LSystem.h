@@ -18,13 +18,46 @@ public:
 	LSystem();
 	~LSystem();
 
-	// Build the L system.
-	void Build(FString axiom, TArray<FString> rules, int iterations);
+	// Build the L system. The same seed, axiom and rules always build the same string.
+	void Build(const LGrammarBuilder& rules, int iterations, int32 seed);
 
-	// Used to access the string generated by the L system.
-	FString GetResult();
+	// Build the L system from rule strings such as "F => F[+F] (0.4)".
+	void Build(const FString& axiom, const TArray<FString>& rules, int iterations, int32 seed);
+
+	// Compiles the grammar without iterating, for use with a streaming expander.
+	void Prepare(const LGrammarBuilder& rules);
+
+	// Sets the directory that compiled grammars are cached in.
+	void SetCacheDirectory(const FString& directory) { Grammar.SetCacheDirectory(directory); };
+
+	// Limits the size of the string, in symbols and in bytes used while building it. 0 means no limit.
+	void SetBudget(int64 maxSymbols, int64 maxBytes) { Grammar.SetBudget(maxSymbols, maxBytes); };
+
+	// Whether the last build stopped early because it reached the budget. Only part of its last iteration was rewritten.
+	bool IsTruncated() const { return Grammar.IsTruncated(); };
+
+	// Used to access the compiled grammar.
+	const LGrammar& GetGrammar() const { return Grammar; };
+
+	// Used to access the modules generated by a parametric L system.
+	const TArray<LModule>& GetModules() const { return Grammar.GetModules(); };
+	bool IsParametric() const { return Grammar.IsParametric(); };
+
+	// Read-only view of the symbols generated by the L system. Each symbol is an index into the grammar's alphabet. The view is valid until the next build.
+	TArrayView<const uint8> GetSymbols() const { return Grammar.GetSymbols(); };
+
+	// When enabled, the generated symbols are packed into 3 bits each if the alphabet is small enough, using 3/8 of the memory. Packed symbols are read with GetPackedSymbols.
+	void SetPackSymbols(bool bPack) { Grammar.SetPackSymbols(bPack); };
+	bool IsPacked() const { return Grammar.IsPacked(); };
+	const LPackedSymbols& GetPackedSymbols() const { return Grammar.GetPackedSymbols(); };
+
+	// Moves the generated symbols out of the L system, for keeping them after the next build. The next build has to allocate a new buffer.
+	TArray<uint8> ReleaseSymbols() { return Grammar.ReleaseSymbols(); };
+
+	// Converts the generated symbols into a string. This copies the whole result, so should only be used for debugging.
+	FString GetResult() const;
 
 private:
-	// The resultant string of the L system.
-	FString Result;
+	// The L system's stochastic grammar. This is kept between builds so that its symbol buffers don't need to be reallocated.
+	LGrammar Grammar;
 };
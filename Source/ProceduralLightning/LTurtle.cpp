@@ -0,0 +1,574 @@
+#include "LTurtle.h"
+#include "LRandom.h"
+#include "Async/ParallelFor.h"
+#include "Async/TaskGraphInterfaces.h"
+
+// Bracket matching scans 16 symbols at a time with SSE2 on x86, or one at a time on anything else.
+#if defined(PLATFORM_CPU_X86_FAMILY) && PLATFORM_CPU_X86_FAMILY && PLATFORM_ENABLE_VECTORINTRINSICS
+#include <emmintrin.h>
+#define LTURTLE_USE_SSE 1
+#else
+#define LTURTLE_USE_SSE 0
+#endif
+
+// Empties the arrays, keeping their memory.
+void LSegmentBuffer::Reset()
+{
+	Starts.Reset();
+	Ends.Reset();
+	Directions.Reset();
+	Depths.Reset();
+	Widths.Reset();
+}
+
+// Adds segments to the end of each array. Their values are written by the turtle.
+int32 LSegmentBuffer::AddUninitialized(int32 num)
+{
+	const int32 first = Num();
+	const int32 total = first + num;
+
+	// Grow each array to exactly fit, rather than with growth slack.
+	if (Starts.Max() < total)
+	{
+		Starts.Reserve(total);
+		Ends.Reserve(total);
+		Directions.Reserve(total);
+		Depths.Reserve(total);
+		Widths.Reserve(total);
+	}
+
+	Starts.AddUninitialized(num);
+	Ends.AddUninitialized(num);
+	Directions.AddUninitialized(num);
+	Depths.AddUninitialized(num);
+	Widths.AddUninitialized(num);
+
+	return first;
+}
+
+// Sets every count back to 0.
+void LSymbolAnalysis::Reset()
+{
+	NumSegments = 0;
+	NumTurnsRight = 0;
+	NumTurnsLeft = 0;
+	MaxDepth = 0;
+	SegmentsPerDepth.Reset();
+}
+
+// Adds up the histogram from the main branch down, stopping before the depth that would go over.
+int32 LSymbolAnalysis::GetDepthWithin(int32 maxSegments) const
+{
+	int32 total = 0;
+
+	for (int32 depth = 0; depth < SegmentsPerDepth.Num(); depth++)
+	{
+		total += SegmentsPerDepth[depth];
+
+		if (total > maxSegments)
+		{
+			return depth - 1;
+		}
+	}
+
+	return FMath::Max(SegmentsPerDepth.Num() - 1, MaxDepth);
+}
+
+// Each symbol takes one hash, which is split into the random numbers it needs. Segments use the top 24 bits as a fraction between 0 and 1. Turns use the top 8 bits and bits 32 to 39 as steps in the rotation table, and the lowest bit as a boolean.
+static float HashFraction(uint64 hash)
+{
+	return (hash >> 40) * (1.0f / 16777216.0f);
+}
+
+LTurtle::LTurtle()
+{
+	Seed = 0;
+	Counter = 0;
+	Position = FVector::ZeroVector;
+	Direction = FVector(0, 0, -1);
+}
+
+LTurtle::~LTurtle()
+{
+}
+
+// Moves the turtle back to the start, with no branches open.
+void LTurtle::Begin(const LTurtleSettings& settings, int32 seed)
+{
+	Settings = settings;
+	Seed = seed;
+
+	TurningTable.Build(settings.MinAngleTurning, settings.MaxAngleTurning);
+	BranchTable.Build(settings.MinAngleBranch, settings.MaxAngleBranch);
+
+	Counter = 0;
+	Position = settings.Start;
+	Direction = settings.Direction;
+	Stack.Reset();
+}
+
+// Number of cores to interpret with.
+int32 LTurtle::GetNumWorkers() const
+{
+	int32 workers = FTaskGraphInterface::Get().GetNumWorkerThreads() + 1;
+
+	if (MaxWorkers > 0)
+	{
+		workers = FMath::Min(workers, MaxWorkers);
+	}
+
+	return FMath::Max(workers, 1);
+}
+
+// Matches a bracket with the stack of open branches. Each '[' is pushed, and each ']' closes the last open branch.
+void LTurtle::AddBracket(TArray<TPair<int32, int32>>& open, int32 position, uint8 symbol, int32 forwardsBefore, int32& counted)
+{
+	// Every segment since the last bracket was drawn with the branches that are open now.
+	Analysis.AddSegments(open.Num(), forwardsBefore - counted);
+	counted = forwardsBefore;
+
+	if (symbol == LSymbol_Save)
+	{
+		Brackets[position] = INDEX_NONE;
+		open.Add(TPair<int32, int32>(position, forwardsBefore));
+		Analysis.MaxDepth = FMath::Max(Analysis.MaxDepth, open.Num());
+	}
+	else if (!open.IsEmpty())
+	{
+		const TPair<int32, int32> branch = open.Pop(false);
+		Brackets[branch.Key] = position;
+		Brackets[position] = forwardsBefore - branch.Value;
+	}
+}
+
+// Finds matching brackets in a single pass with a stack of open branches. The number of segments before each bracket is counted along the way, so the number of segments in a branch is the count at its ']' minus the count at its '['.
+// The scan looks at 16 symbols at a time. Blocks without brackets only need their segments and turns counted, and the brackets in other blocks are found from a bit mask.
+int32 LTurtle::Analyze(TArrayView<const uint8> symbols)
+{
+	SCOPE_CYCLE_COUNTER(STAT_AnalyzeSymbols)
+	{
+		const int32 num = symbols.Num();
+		const uint8* data = symbols.GetData();
+
+		if (Brackets.Max() < num)
+		{
+			Brackets.Empty(num);
+		}
+
+		Brackets.SetNumUninitialized(num, false);
+		Analysis.Reset();
+
+		// The position of each open branch, and the number of segments before it.
+		TArray<TPair<int32, int32>> open;
+		int32 forwards = 0;
+		int32 counted = 0;
+
+		int32 i = 0;
+
+#if LTURTLE_USE_SSE
+		const __m128i forward = _mm_set1_epi8((char)LSymbol_Forward);
+		const __m128i right = _mm_set1_epi8((char)LSymbol_RotateRight);
+		const __m128i left = _mm_set1_epi8((char)LSymbol_RotateLeft);
+		const __m128i save = _mm_set1_epi8((char)LSymbol_Save);
+		const __m128i ret = _mm_set1_epi8((char)LSymbol_Return);
+
+		for (; i + 16 <= num; i += 16)
+		{
+			const __m128i block = _mm_loadu_si128((const __m128i*)(data + i));
+			const uint32 forwardMask = (uint32)_mm_movemask_epi8(_mm_cmpeq_epi8(block, forward));
+			uint32 bracketMask = (uint32)_mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(block, save), _mm_cmpeq_epi8(block, ret)));
+
+			Analysis.NumTurnsRight += FMath::CountBits((uint32)_mm_movemask_epi8(_mm_cmpeq_epi8(block, right)));
+			Analysis.NumTurnsLeft += FMath::CountBits((uint32)_mm_movemask_epi8(_mm_cmpeq_epi8(block, left)));
+
+			// Go through the brackets in order. The segments before each one are the ones below it in the mask.
+			while (bracketMask != 0)
+			{
+				const uint32 bit = FMath::CountTrailingZeros(bracketMask);
+				bracketMask &= bracketMask - 1;
+
+				AddBracket(open, i + bit, data[i + bit], forwards + FMath::CountBits(forwardMask & ((1u << bit) - 1)), counted);
+			}
+
+			forwards += FMath::CountBits(forwardMask);
+		}
+#endif
+
+		for (; i < num; i++)
+		{
+			if (data[i] == LSymbol_Save || data[i] == LSymbol_Return)
+			{
+				AddBracket(open, i, data[i], forwards, counted);
+			}
+
+			forwards += data[i] == LSymbol_Forward;
+			Analysis.NumTurnsRight += data[i] == LSymbol_RotateRight;
+			Analysis.NumTurnsLeft += data[i] == LSymbol_RotateLeft;
+		}
+
+		// The segments after the last bracket.
+		Analysis.AddSegments(open.Num(), forwards - counted);
+		Analysis.NumSegments = forwards;
+
+		return forwards;
+	}
+}
+
+// The same scan as for bytes, a word of 21 symbols at a time. Every symbol in a word is compared at once, giving a mask with the lowest bit of each matching symbol set.
+int32 LTurtle::Analyze(const LPackedSymbols& symbols)
+{
+	SCOPE_CYCLE_COUNTER(STAT_AnalyzeSymbols)
+	{
+		const int32 num = symbols.Num();
+		const uint64* words = symbols.GetWords();
+
+		if (Brackets.Max() < num)
+		{
+			Brackets.Empty(num);
+		}
+
+		Brackets.SetNumUninitialized(num, false);
+		Analysis.Reset();
+
+		TArray<TPair<int32, int32>> open;
+		int32 forwards = 0;
+		int32 counted = 0;
+
+		for (int32 w = 0; w < symbols.NumWords(); w++)
+		{
+			const uint64 word = words[w];
+
+			// Unused symbols at the end of the last word are 0, the same as F, so they are masked out.
+			const uint64 valid = symbols.GetValidLanes(w);
+			const uint64 forwardLanes = LPackedSymbols::MatchLanes(word, LSymbol_Forward) & valid;
+			uint64 bracketLanes = (LPackedSymbols::MatchLanes(word, LSymbol_Save) | LPackedSymbols::MatchLanes(word, LSymbol_Return)) & valid;
+
+			Analysis.NumTurnsRight += FMath::CountBits(LPackedSymbols::MatchLanes(word, LSymbol_RotateRight) & valid);
+			Analysis.NumTurnsLeft += FMath::CountBits(LPackedSymbols::MatchLanes(word, LSymbol_RotateLeft) & valid);
+
+			while (bracketLanes != 0)
+			{
+				const uint32 bit = (uint32)FMath::CountTrailingZeros64(bracketLanes);
+				bracketLanes &= bracketLanes - 1;
+
+				const int32 position = w * LPackedSymbols::SymbolsPerWord + bit / LPackedSymbols::BitsPerSymbol;
+				AddBracket(open, position, (uint8)((word >> bit) & LPackedSymbols::SymbolMask), forwards + FMath::CountBits(forwardLanes & ((1ull << bit) - 1)), counted);
+			}
+
+			forwards += FMath::CountBits(forwardLanes);
+		}
+
+		Analysis.AddSegments(open.Num(), forwards - counted);
+		Analysis.NumSegments = forwards;
+
+		return forwards;
+	}
+}
+
+// Interprets the string as a tree of tasks. The first task is the whole string. Each task skips over its long branches, adding them as tasks that start from the state at their '[', and the tasks found are run in parallel once the tasks before them are done.
+// Every task knows where its segments go from the number of segments before it, so the output is the same however many cores are used.
+void LTurtle::Interpret(TArrayView<const uint8> symbols, LSegmentBuffer& segments)
+{
+	SCOPE_CYCLE_COUNTER(STAT_Interpret)
+	{
+		InterpretTasks(symbols, Analyze(symbols), segments);
+	}
+}
+
+// Packed symbols are read where they are, so the string is never unpacked into bytes.
+void LTurtle::Interpret(const LPackedSymbols& symbols, LSegmentBuffer& segments)
+{
+	SCOPE_CYCLE_COUNTER(STAT_Interpret)
+	{
+		InterpretTasks(symbols, Analyze(symbols), segments);
+	}
+}
+
+template <typename SymbolsType>
+void LTurtle::InterpretTasks(const SymbolsType& symbols, int32 numSegments, LSegmentBuffer& segments)
+{
+	const int32 firstSegment = segments.AddUninitialized(numSegments);
+
+	// Branches are only split off when there is more than one core to run them.
+	const bool bIsParallel = GetNumWorkers() > 1 && symbols.Num() >= MinTaskSymbols * 2;
+
+	TArray<Task> tasks;
+	tasks.Add({ 0, symbols.Num(), firstSegment, { Position, Direction }, Stack.Num() });
+
+	TArray<TArray<Task>> subtasks;
+
+	while (!tasks.IsEmpty())
+	{
+		subtasks.Reset();
+		subtasks.SetNum(tasks.Num());
+
+		ParallelFor(tasks.Num(), [this, &symbols, &tasks, &segments, &subtasks, bIsParallel](int32 t)
+		{
+			InterpretTask(symbols, tasks[t], segments, bIsParallel ? &subtasks[t] : nullptr);
+		}, !bIsParallel || tasks.Num() == 1);
+
+		// The next tasks are kept in order, although each task writes to its own segments so the order doesn't change the result.
+		tasks.Reset();
+		for (TArray<Task>& found : subtasks)
+		{
+			tasks.Append(found);
+		}
+	}
+
+	Counter += symbols.Num();
+}
+
+// Interprets a range of symbols from a task's state.
+template <typename SymbolsType>
+void LTurtle::InterpretTask(const SymbolsType& symbols, const Task& task, LSegmentBuffer& segments, TArray<Task>* subtasks) const
+{
+	FVector position = task.Start.Position;
+	FVector direction = task.Start.Direction;
+	int32 segment = task.FirstSegment;
+
+	TArray<State, TInlineAllocator<32>> stack;
+
+	for (int32 i = task.Begin; i < task.End; i++)
+	{
+		const int32 depth = task.Depth + stack.Num();
+
+		switch (symbols[i])
+		{
+		case LSymbol_Forward:
+		{
+			const float length = GetLength(GetRandom(Counter + i));
+			WriteSegment(segments, segment++, position, direction, length, GetWidth(depth), depth);
+			position += direction * length;
+			break;
+		}
+		case LSymbol_RotateRight:
+			Rotate(direction, 1.0f, GetRandom(Counter + i), depth);
+			break;
+		case LSymbol_RotateLeft:
+			Rotate(direction, -1.0f, GetRandom(Counter + i), depth);
+			break;
+		case LSymbol_Save:
+		{
+			// A long branch becomes a task of its own. The state after the branch is the same as before it, so this task carries on from the ']' with the segments of the branch skipped.
+			const int32 match = Brackets[i];
+
+			if (subtasks && match != INDEX_NONE && match - i >= MinTaskSymbols)
+			{
+				subtasks->Add({ i + 1, match, segment, { position, direction }, depth + 1 });
+				segment += Brackets[match];
+				i = match;
+			}
+			else
+			{
+				stack.Add({ position, direction });
+			}
+			break;
+		}
+		case LSymbol_Return: // Unmatched brackets are ignored.
+			if (!stack.IsEmpty())
+			{
+				const State state = stack.Pop(false);
+				position = state.Position;
+				direction = state.Direction;
+			}
+			break;
+		default:
+			break;
+		}
+	}
+}
+
+// Shared nodes are walked again each time they appear, as each one starts from a different position and direction and its symbols have different random numbers.
+// The segments are written in order on one core, as a branch's starting state is only known once the symbols before it have been walked.
+void LTurtle::Interpret(const LDerivationDag& dag, LSegmentBuffer& segments)
+{
+	SCOPE_CYCLE_COUNTER(STAT_Interpret)
+	{
+		int32 segment = segments.AddUninitialized((int32)dag.GetNumSegments());
+
+		FVector position = Position;
+		FVector direction = Direction;
+		TArray<State, TInlineAllocator<32>> stack;
+		int64 counter = Counter;
+
+		// The DAG's string is never scanned on its own, so it is analyzed while it is walked.
+		Analysis.Reset();
+
+		dag.ForEachSymbol([&](uint8 symbol)
+		{
+			const int32 depth = Stack.Num() + stack.Num();
+			CountSymbol(symbol, stack.Num());
+
+			switch (symbol)
+			{
+			case LSymbol_Forward:
+			{
+				const float length = GetLength(GetRandom(counter));
+				WriteSegment(segments, segment++, position, direction, length, GetWidth(depth), depth);
+				position += direction * length;
+				break;
+			}
+			case LSymbol_RotateRight:
+				Rotate(direction, 1.0f, GetRandom(counter), depth);
+				break;
+			case LSymbol_RotateLeft:
+				Rotate(direction, -1.0f, GetRandom(counter), depth);
+				break;
+			case LSymbol_Save:
+				stack.Add({ position, direction });
+				break;
+			case LSymbol_Return: // Unmatched brackets are ignored.
+				if (!stack.IsEmpty())
+				{
+					const State state = stack.Pop(false);
+					position = state.Position;
+					direction = state.Direction;
+				}
+				break;
+			default:
+				break;
+			}
+
+			counter++;
+		});
+
+		Counter = counter;
+	}
+}
+
+// Interprets parametric modules in one pass. Only turns use random numbers.
+void LTurtle::Interpret(TArrayView<const LModule> modules, LSegmentBuffer& segments)
+{
+	SCOPE_CYCLE_COUNTER(STAT_Interpret)
+	{
+		// Modules already know their depth, so they are analyzed without matching brackets.
+		Analysis.Reset();
+		for (const LModule& module : modules)
+		{
+			CountSymbol(module.Symbol, module.Depth);
+		}
+
+		int32 segment = segments.AddUninitialized(Analysis.NumSegments);
+
+		for (const LModule& module : modules)
+		{
+			if (module.Symbol == LSymbol_Forward)
+			{
+				// Dynamic branch width overrides the width of branches, as it does for symbols without parameters.
+				const int32 depth = module.Depth;
+				const float width = (Settings.bDynamicBranchWidth && depth > 0) ? Settings.MaxWidth / depth : module.Params[LParam_Width];
+
+				WriteSegment(segments, segment++, Position, Direction, module.Params[LParam_Length], width, depth);
+				Position += Direction * module.Params[LParam_Length];
+				Counter++;
+			}
+			else
+			{
+				Step(module.Symbol, segments);
+			}
+		}
+	}
+}
+
+// Counts a symbol drawn at a depth. A '[' opens a branch one deeper than it.
+void LTurtle::CountSymbol(uint8 symbol, int32 depth)
+{
+	switch (symbol)
+	{
+	case LSymbol_Forward:
+		Analysis.AddSegments(depth, 1);
+		Analysis.NumSegments++;
+		break;
+	case LSymbol_RotateRight:
+		Analysis.NumTurnsRight++;
+		break;
+	case LSymbol_RotateLeft:
+		Analysis.NumTurnsLeft++;
+		break;
+	case LSymbol_Save:
+		Analysis.MaxDepth = FMath::Max(Analysis.MaxDepth, depth + 1);
+		break;
+	default:
+		break;
+	}
+}
+
+// Interprets a single symbol. Symbols that aren't drawn are skipped.
+bool LTurtle::Step(uint8 symbol, LSegmentBuffer& segments)
+{
+	const int64 position = Counter++;
+	const int32 depth = Stack.Num();
+
+	switch (symbol)
+	{
+	case LSymbol_Forward: // Draw a segment of random length.
+	{
+		const float length = GetLength(GetRandom(position));
+		WriteSegment(segments, segments.AddUninitialized(1), Position, Direction, length, GetWidth(depth), depth);
+		Position += Direction * length;
+		return true;
+	}
+	case LSymbol_RotateRight:
+		Rotate(Direction, 1.0f, GetRandom(position), depth);
+		break;
+	case LSymbol_RotateLeft:
+		Rotate(Direction, -1.0f, GetRandom(position), depth);
+		break;
+	case LSymbol_Save: // Save the state at the start of a branch.
+		Stack.Add({ Position, Direction });
+		break;
+	case LSymbol_Return: // Return to the state before the branch. Unmatched brackets are ignored.
+		if (!Stack.IsEmpty())
+		{
+			const State state = Stack.Pop(false);
+			Position = state.Position;
+			Direction = state.Direction;
+		}
+		break;
+	default:
+		break;
+	}
+
+	return false;
+}
+
+// Writes a segment from a position in a direction.
+void LTurtle::WriteSegment(LSegmentBuffer& segments, int32 index, const FVector& position, const FVector& direction, float length, float width, int32 depth)
+{
+	segments.Starts[index] = position;
+	segments.Ends[index] = position + direction * length;
+	segments.Directions[index] = direction;
+	segments.Depths[index] = (uint8)FMath::Min(depth, (int32)MAX_uint8);
+	segments.Widths[index] = width;
+}
+
+// Rotates a direction. The main branch and other branches have separate angles, as the main branch should turn less.
+// Rotation is applied in 2 dimensions if 3D mode is enabled, with equal chance of the Y rotation being forwards or backwards. Otherwise it is just applied in the X dimension.
+void LTurtle::Rotate(FVector& direction, float sign, uint64 random, int32 depth) const
+{
+	const LRotationTable& table = depth == 0 ? TurningTable : BranchTable;
+	table.Rotate(direction, sign, (uint32)(random >> 56), (uint32)(random >> 32) & 0xFF, (random & 1) == 0, Settings.bIs3DEnabled);
+}
+
+// A random length between the min and max segment length.
+float LTurtle::GetLength(uint64 random) const
+{
+	return FMath::Lerp(Settings.MinSegmentLength, Settings.MaxSegmentLength, HashFraction(random));
+}
+
+// The main branch uses the max width. Other branches use a multiplier, which is based on depth when dynamic branch width is enabled.
+float LTurtle::GetWidth(int32 depth) const
+{
+	if (depth == 0)
+	{
+		return Settings.MaxWidth;
+	}
+
+	return Settings.MaxWidth * (Settings.bDynamicBranchWidth ? 1.0f / depth : Settings.BranchWidthMultiplier);
+}
+
+// The random numbers for a symbol come from its position in the string, counted from the last Begin.
+uint64 LTurtle::GetRandom(int64 position) const
+{
+	return LRandom::Hash((uint32)Seed, LRandomStream_Turtle, (uint64)position);
+}
@@ -0,0 +1,202 @@
+// Turtle interpreter for the L system. This turns symbols into lightning segments in a single pass, without spawning anything or touching the lightning generator, so it can be timed on its own and run on any thread.
+// Random numbers come from the position of each symbol rather than from a sequence, so a symbol is always drawn the same way however the symbols are given to the turtle.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "LGrammar.h"
+#include "LDerivationDag.h"
+#include "LRotationTable.h"
+
+DECLARE_CYCLE_STAT(TEXT("Interpret"), STAT_Interpret, STATGROUP_LSystem);
+DECLARE_CYCLE_STAT(TEXT("Analyze Symbols"), STAT_AnalyzeSymbols, STATGROUP_LSystem);
+
+// How the turtle draws the lightning. These come from the lightning generator's L-system properties.
+struct LTurtleSettings
+{
+	FVector Start;
+	FVector Direction;
+
+	float MinSegmentLength;
+	float MaxSegmentLength;
+
+	// Turning angles are used on the main branch, and branching angles everywhere else.
+	float MinAngleTurning;
+	float MaxAngleTurning;
+	float MinAngleBranch;
+	float MaxAngleBranch;
+
+	float MaxWidth;
+	float BranchWidthMultiplier;
+
+	bool bIs3DEnabled;
+	bool bDynamicBranchWidth;
+};
+
+// Segments drawn by the turtle, stored as a structure of arrays. Segment i is the ith element of each array, so each property can be read without loading the others.
+struct PROCEDURALLIGHTNING_API LSegmentBuffer
+{
+	TArray<FVector> Starts;
+	TArray<FVector> Ends;
+	TArray<FVector> Directions;
+	TArray<uint8> Depths;
+	TArray<float> Widths;
+
+	int32 Num() const { return Starts.Num(); };
+
+	// Empties the arrays, keeping their memory.
+	void Reset();
+
+	// Adds a number of segments to be written later, and returns the index of the first one. The arrays are grown to exactly fit them.
+	int32 AddUninitialized(int32 num);
+};
+
+// What a string draws, found in the same pass that matches its brackets. Depths are the number of branches open, not counting any the turtle had open before the string.
+struct PROCEDURALLIGHTNING_API LSymbolAnalysis
+{
+	int32 NumSegments = 0;
+	int32 NumTurnsRight = 0;
+	int32 NumTurnsLeft = 0;
+	int32 MaxDepth = 0;
+
+	// The number of segments at each depth.
+	TArray<int32> SegmentsPerDepth;
+
+	// Sets every count back to 0, keeping the histogram's memory.
+	void Reset();
+
+	// Adds segments to the histogram at a depth.
+	void AddSegments(int32 depth, int32 num)
+	{
+		if (SegmentsPerDepth.Num() <= depth)
+		{
+			SegmentsPerDepth.SetNumZeroed(depth + 1);
+		}
+
+		SegmentsPerDepth[depth] += num;
+	};
+
+	// Returns the deepest depth where the segments at that depth and every depth above it number no more than maxSegments. Returns -1 if the main branch alone has more.
+	int32 GetDepthWithin(int32 maxSegments) const;
+};
+
+/**
+ * 
+ */
+class PROCEDURALLIGHTNING_API LTurtle
+{
+public:
+	// Constructor and destructor.
+	LTurtle();
+	~LTurtle();
+
+	// Starts drawing from the settings' start position and direction, with random numbers from the seed.
+	void Begin(const LTurtleSettings& settings, int32 seed);
+
+	// Interprets a whole string, adding the segments drawn to the buffer. Branches that are long enough are interpreted in parallel, and each segment is written to the same place it would be by a single core.
+	void Interpret(TArrayView<const uint8> symbols, LSegmentBuffer& segments);
+
+	// Interprets a string of packed symbols, drawing the same segments as the same symbols in bytes.
+	void Interpret(const LPackedSymbols& symbols, LSegmentBuffer& segments);
+
+	// Interprets a shared derivation by walking down its nodes, so the string is never written out. Draws the same segments as the DAG's flattened string.
+	void Interpret(const LDerivationDag& dag, LSegmentBuffer& segments);
+
+	// Interprets parametric modules. Segment lengths, widths and depths come from each module rather than from random numbers.
+	void Interpret(TArrayView<const LModule> modules, LSegmentBuffer& segments);
+
+	// Interprets a single symbol, for symbols that are given out one at a time. Returns true if a segment was drawn.
+	bool Step(uint8 symbol, LSegmentBuffer& segments);
+
+	// The analysis of the last string interpreted.
+	const LSymbolAnalysis& GetAnalysis() const { return Analysis; };
+
+	// Limits the number of cores used to interpret. 0 uses every available core.
+	void SetMaxWorkers(int32 workers) { MaxWorkers = workers; };
+
+private:
+	// A position and direction, saved at the start of a branch.
+	struct State
+	{
+		FVector Position;
+		FVector Direction;
+	};
+
+	// A range of symbols that can be interpreted on its own, as it only depends on the state it starts from.
+	struct Task
+	{
+		int32 Begin;
+		int32 End;
+
+		// The index of the task's first segment in the output.
+		int32 FirstSegment;
+
+		State Start;
+		int32 Depth;
+	};
+
+	// Finds the matching bracket of every branch and the number of segments inside it, and fills in the analysis. Returns the number of segments in the whole string.
+	int32 Analyze(TArrayView<const uint8> symbols);
+	int32 Analyze(const LPackedSymbols& symbols);
+
+	// Adds a bracket found by Analyze, matching it with the open branches. The segments since the last bracket are added to the histogram at the depth they were drawn, which is counted up to.
+	void AddBracket(TArray<TPair<int32, int32>>& open, int32 position, uint8 symbol, int32 forwardsBefore, int32& counted);
+
+	// Counts a symbol that is interpreted without being analyzed first.
+	void CountSymbol(uint8 symbol, int32 depth);
+
+	// Interprets the string from its matched brackets, as a tree of tasks. Symbols are either a view of bytes or packed symbols.
+	template <typename SymbolsType>
+	void InterpretTasks(const SymbolsType& symbols, int32 numSegments, LSegmentBuffer& segments);
+
+	// Interprets a task's symbols. Branches of at least MinTaskSymbols are added to the subtasks rather than interpreted, if there are subtasks.
+	template <typename SymbolsType>
+	void InterpretTask(const SymbolsType& symbols, const Task& task, LSegmentBuffer& segments, TArray<Task>* subtasks) const;
+
+	// Number of cores to interpret with. The game thread helps with parallel work, so it counts as a worker.
+	int32 GetNumWorkers() const;
+
+	// Drawing functions shared by every way of interpreting.
+	// *** //
+	// Writes a segment from a position in a direction.
+	static void WriteSegment(LSegmentBuffer& segments, int32 index, const FVector& position, const FVector& direction, float length, float width, int32 depth);
+
+	// Turns a direction by random angles from the rotation tables. Right turns use a sign of 1, left turns -1.
+	void Rotate(FVector& direction, float sign, uint64 random, int32 depth) const;
+
+	// The random length of a segment.
+	float GetLength(uint64 random) const;
+
+	// The width of a segment at a branch depth, for symbols without parameters.
+	float GetWidth(int32 depth) const;
+
+	// The random numbers for the symbol at a position.
+	uint64 GetRandom(int64 position) const;
+	// *** //
+
+	LTurtleSettings Settings;
+
+	// Precomputed turns for the main branch and for other branches.
+	LRotationTable TurningTable;
+	LRotationTable BranchTable;
+
+	// The seed, and the position of the next symbol. Each symbol's random numbers come from these.
+	int32 Seed;
+	int64 Counter;
+
+	// The current position and direction, and the states saved at the start of each open branch.
+	FVector Position;
+	FVector Direction;
+	TArray<State> Stack;
+
+	// For each '[', the position of its matching ']', or -1 if it isn't closed. For each ']', the number of segments in its branch.
+	TArray<int32> Brackets;
+
+	LSymbolAnalysis Analysis;
+
+	// Branches shorter than this are interpreted by the task they are in, as they aren't worth the cost of a task.
+	static constexpr int32 MinTaskSymbols = 4096;
+
+	// Maximum number of cores to interpret with, 0 for no limit.
+	int32 MaxWorkers = 0;
+};
@@ -1,27 +1,38 @@
 #include "LightningGenerator.h"
 #include "UObject/ConstructorHelpers.h"
 #include "Kismet/GameplayStatics.h"
-#include "Kismet/KismetMathLibrary.h"
+#include "Async/TaskGraphInterfaces.h"
+#include "Misc/Paths.h"
+#include "Misc/StringBuilder.h"
 
 
 
 // Sets default values
-ALightningGenerator::ALightningGenerator()
+ALightningGenerator::ALightningGenerator() : BoltBuilder(MakeShared<LBoltBuilder>()), PoolBuilder(MakeShared<LBoltBuilder>()), SegmentStream(MakeShared<LSegmentStream>())
 {
  	// Set this actor to call Tick() every frame.
 	PrimaryActorTick.bCanEverTick = true;
 
 	// Setting default property values.
 	// *** //
-	Axiom = "F";
+	Rules.SetAxiom(TEXT("F"));
 	BranchChance = 0.8;
 	TurnChance = 0.7;
 	Iterations = 6;
+	MaxSymbols = 16000000;
+	MaxMemoryMB = 512;
+	bPackSymbols = true;
+	bShareSubtrees = false;
+	MaxDrawnSegments = 0;
+	bEstimateDirty = true;
+	bAutoTuneCost = false;
+	StrikeBudgetMs = 50.0f;
+	DrawDepth = MAX_int32;
+	SubtreeVariants = 16;
 	Speed = 5;
 	bAnimateLightning = false;
 
 	bUsePhysicsModel = false;
-	PModel.Set3DMode(&bIs3DEnabled);
 
 	ParticleCount = 7;
 	LightningColor = { 0.11f, 0.22, 0.49, 1 };
@@ -53,10 +64,40 @@ ALightningGenerator::ALightningGenerator()
 	ImGuiScale = 2.0f;
 	RenderTime = 0.0f;
 	GenerationTime = 0.0f;
+	TimeToFirstSegment = 0.0f;
+	SpawnTime = 0.0;
+	bAwaitingFirstSegment = false;
 
 	bIs3DEnabled = true;
 	bDynamicBranchWidth = false;
 	bHideFirstSegment = false;
+	bStreamLSystem = false;
+	bIsStreaming = false;
+	bPipelineLSystem = false;
+	bIsPipelined = false;
+	bParametricLSystem = false;
+	SegmentCursor = 0;
+	DirtyStage = LStage_Count;
+	bHasLSystemStrike = false;
+	QueuedStage = LStage_Count;
+	bReplaceOnPublish = false;
+	bPendingForPool = false;
+	PendingPoolVersion = 0;
+	PoolDepth = 2;
+	PoolHead = 0;
+	PoolCount = 0;
+	PoolVersion = 0;
+	bSpawnWaiting = false;
+
+	// Each generator gets its own seed, so generators spawning at the same time create different lightning.
+	Seed = (int32)LRandom::Hash(FPlatformTime::Cycles64(), GetUniqueID(), 0);
+	bUseFixedSeed = false;
+	StrikeSeed = Seed;
+	StrikeCount = 0;
+
+	GrammarRandomTimes[0] = GrammarRandomTimes[1] = 0.0f;
+	PhysicsRandomTimes[0] = PhysicsRandomTimes[1] = 0.0f;
+	TurtleThroughput[0] = TurtleThroughput[1] = 0.0f;
 	// *** //
 
 	// Generate L-system rules using L-system values.
@@ -72,7 +113,7 @@ ALightningGenerator::ALightningGenerator()
 void ALightningGenerator::BuildLSystem() 
 {
 	// Call the L system's build function using the defined axiom, rules and no. of iterations.
-	System.Build(Axiom, Rules, Iterations);
+	System.Build(Rules, Iterations, Seed);
 }
 
 FString ALightningGenerator::GetString()
@@ -86,45 +127,55 @@ void ALightningGenerator::BeginPlay()
 {
 	Super::BeginPlay();
 
+	// Compiled grammars are cached in the saved directory, so rules only need to be parsed the first time they are used.
+	System.SetCacheDirectory(FPaths::ProjectSavedDir() / TEXT("LSystemCache"));
+	BoltBuilder->SetCacheDirectory(FPaths::ProjectSavedDir() / TEXT("LSystemCache"));
+	PoolBuilder->SetCacheDirectory(FPaths::ProjectSavedDir() / TEXT("LSystemCache"));
+	SegmentStream->SetCacheDirectory(FPaths::ProjectSavedDir() / TEXT("LSystemCache"));
+
 	// Lightning spawned on begin play.
 	SpawnLightning();
 }
 
-// Counts the number of lightning segments generated by the L-system.
-int ALightningGenerator::CountSegments()
+void ALightningGenerator::EndPlay(const EEndPlayReason::Type EndPlayReason)
 {
-	int segments = 0;
+	StopPipeline();
 
-	// Get the generated string from the L system, converted to an array of chars.
-	auto charArray = System.GetResult().GetCharArray();
-	
-	// Iterate through each char in the array. Every F (forward) counts as a new lightning segment.
-	for (int i = 0; i < charArray.Num(); i++)
-	{
-		if (charArray[i] == 'F')
-		{
-			segments++;
-		}
-	}
+	Super::EndPlay(EndPlayReason);
+}
 
-	return segments;
+// The turtle draws with the L-system properties, starting from the draw position.
+LTurtleSettings ALightningGenerator::GetTurtleSettings() const
+{
+	LTurtleSettings settings;
+	settings.Start = DrawPosition;
+	settings.Direction = LightningDirection;
+	settings.MinSegmentLength = MinSegmentLength;
+	settings.MaxSegmentLength = MaxSegmentLength;
+	settings.MinAngleTurning = MinAngleTurning;
+	settings.MaxAngleTurning = MaxAngleTurning;
+	settings.MinAngleBranch = MinAngleBranch;
+	settings.MaxAngleBranch = MaxAngleBranch;
+	settings.MaxWidth = MaxWidth;
+	settings.BranchWidthMultiplier = BranchWidthMultiplier;
+	settings.bIs3DEnabled = bIs3DEnabled;
+	settings.bDynamicBranchWidth = bDynamicBranchWidth;
+
+	return settings;
 }
 
 // Draw a segment of the lightning from the L-system. Each segment has it's own small particle system. 
-void ALightningGenerator::DrawSegment()
+void ALightningGenerator::DrawSegment(const LSegmentBuffer& segments, int32 index)
 {
-	float scale = 4;
-
-	// Generate the length of the segment.
-	SegmentLength = FMath::RandRange(MinSegmentLength, MaxSegmentLength);
+	// Start and end positions, width and depth were worked out by the turtle.
+	const FVector startPos = segments.Starts[index];
+	const FVector endPos = segments.Ends[index];
+	const float width = segments.Widths[index];
+	const int32 depth = segments.Depths[index];
 
 	// Spawns a lightning particle system. This draws a line between two points, and applies jitter to give it the zig-zaggy lightning look.
 	UNiagaraComponent* lightningSegment = UNiagaraFunctionLibrary::SpawnSystemAtLocation(GetWorld(), LightningTemplate, FVector(0, 0, 0));
 
-	// Start position of the segment is the current draw position. End position is start position + the calculated length in the direction the lightning is moving.
-	FVector startPos = DrawPosition;
-	FVector endPos = startPos + (LightningDirection * SegmentLength);
-
 	// Sets the parameters of the lightning particle system.
 	lightningSegment->SetVectorParameter(FName("Start"), startPos);
 	lightningSegment->SetVectorParameter(FName("End"), endPos);
@@ -136,144 +187,25 @@ void ALightningGenerator::DrawSegment()
 	lightningSegment->SetVectorParameter(FName("SpherePos"), endPos);
 	lightningSegment->SetFloatParameter(FName("SphereLifespan"), ParticleLifespan - GetWorld()->GetDeltaSeconds() * SphereLifespanOffset);
 
-
-	FLinearColor finalColor;
-
-	// If the segment is part of the main branch, use max values for remaining parameters.
-	if (SavedPositions.Num() == 0)
-	{
-		finalColor = LightningColor * ColorIntensity;
-		lightningSegment->SetColorParameter(FName("Color"), finalColor);
-		lightningSegment->SetFloatParameter(FName("MinWidth"), MaxWidth);
-		lightningSegment->SetFloatParameter(FName("MaxWidth"), MaxWidth);
-		lightningSegment->SetVectorParameter(FName("SphereScale"), SphereScale * MaxWidth);
-	}
-	else // If the segment is not in the main branch...
-	{
-		// If dynamic branch width is enabled, the multiplier will be based on branch depth. Otherwise a fixed value is used.
-		float multiplier;
-		if (bDynamicBranchWidth)
-		{
-			multiplier = 1.0f / SavedPositions.Num();
-		}
-		else
-		{
-			multiplier = BranchWidthMultiplier;
-		}
-		
-		// Regardless of dynamic branch width, deeper branches will have a less intense colour, resulting in less light being emitted.
-		finalColor = LightningColor * ColorIntensity * (0.5f / SavedPositions.Num());
-		lightningSegment->SetColorParameter(FName("Color"), finalColor);
-
-		// Multiplier applied for width.
-		lightningSegment->SetFloatParameter(FName("MinWidth"), MaxWidth * multiplier);
-		lightningSegment->SetFloatParameter(FName("MaxWidth"), MaxWidth * multiplier);
-		lightningSegment->SetVectorParameter(FName("SphereScale"), SphereScale * MaxWidth * multiplier);
-	}
+	// The main branch uses the full colour. Deeper branches have a less intense colour, resulting in less light being emitted.
+	FLinearColor finalColor = LightningColor * ColorIntensity * (depth == 0 ? 1.0f : 0.5f / depth);
+	lightningSegment->SetColorParameter(FName("Color"), finalColor);
+	lightningSegment->SetFloatParameter(FName("MinWidth"), width);
+	lightningSegment->SetFloatParameter(FName("MaxWidth"), width);
+	lightningSegment->SetVectorParameter(FName("SphereScale"), SphereScale * width);
 	
 	// Save particles to an array so they can be accessed later, such as if they need to be destroyed early.
 	SegmentParticles.Add(lightningSegment);
-
-	// Update the draw position.
-	DrawPosition = endPos;
-}
-
-// Rotates the lightning segment direction right.
-void ALightningGenerator::RotateRight()
-{
-	float randomAngleX, randomAngleY;
-
-	// Generate random angle and rotator, then apply it to the lightning's direction to rotate it.
-	// The main branch and other branches have separate values, as the main branch should turn less.
-	if (SavedPositions.Num() == 0)
-	{
-		randomAngleX = FMath::RandRange(MinAngleTurning, MaxAngleTurning);
-		randomAngleY = FMath::RandRange(MinAngleTurning, MaxAngleTurning);
-	}
-	else
-	{
-		randomAngleX = FMath::RandRange(MinAngleBranch, MaxAngleBranch);
-		randomAngleY = FMath::RandRange(MinAngleBranch, MaxAngleBranch);
-	}
-	 
-	FRotator rotation;
-
-	// Rotation is applied in 2 dimensions if 3D mode is enabled. Otherwise it is just applied in the X dimension.
-	if (bIs3DEnabled)
-	{
-		if (UKismetMathLibrary::RandomBool()) // Random boolean decides with equal chance whether the Y rotation will be forwards or backwards.
-		{
-			rotation = FRotator(randomAngleX, randomAngleY, 0);
-		}
-		else
-		{
-			rotation = FRotator(randomAngleX, -randomAngleY, 0);
-		}
-	}
-	else
-	{
-		rotation = FRotator(randomAngleX, 0, 0);
-	}
-	
-	// Apply rotation to the lightning's direction.
-	LightningDirection = rotation.RotateVector(LightningDirection);
+	MarkSegmentDrawn();
 }
 
-// Rotates the lightning segment direction left.
-void ALightningGenerator::RotateLeft()
+void ALightningGenerator::MarkSegmentDrawn()
 {
-	float randomAngleX, randomAngleY; 
-
-	// Generate random angle and rotator (with angle negated), then apply it to the lightning's direction to rotate it.
-	// The main branch and other branches have separate values, as the main branch should turn less.
-	if (SavedPositions.Num() == 0)
-	{
-		randomAngleX = FMath::RandRange(MinAngleTurning, MaxAngleTurning);
-		randomAngleY = FMath::RandRange(MinAngleTurning, MaxAngleTurning);
-	}
-	else
-	{
-		randomAngleX = FMath::RandRange(MinAngleBranch, MaxAngleBranch);
-		randomAngleY = FMath::RandRange(MinAngleBranch, MaxAngleBranch);
-	}
-
-	FRotator rotation; 
-
-	// Rotation is applied in 2 dimensions if 3D mode is enabled. Otherwise it is just applied in the X dimension.
-	if (bIs3DEnabled)
-	{
-		if (UKismetMathLibrary::RandomBool()) // Random boolean decides with equal chance whether the Y rotation will be forwards or backwards.
-		{
-			rotation = FRotator(-randomAngleX, randomAngleY, 0);
-		}
-		else
-		{
-			rotation = FRotator(-randomAngleX, -randomAngleY, 0);
-		}
-	}
-	else
+	if (bAwaitingFirstSegment)
 	{
-		rotation = FRotator(-randomAngleX, 0, 0);
+		TimeToFirstSegment = FPlatformTime::Seconds() - SpawnTime;
+		bAwaitingFirstSegment = false;
 	}
-
-	// Apply rotation to the lightning's direction.
-	LightningDirection = rotation.RotateVector(LightningDirection);
-}
-
-// Save the state of the lightning.
-void ALightningGenerator::Save()
-{
-	// Add to position and direction arrays/stacks.
-	SavedDirections.Add(LightningDirection);
-	SavedPositions.Add(DrawPosition);
-}
-
-// Return to previous lightning state.
-void ALightningGenerator::Return()
-{
-	// Pop from position and direction arrays/stacks.
-	LightningDirection = SavedDirections.Pop();
-	DrawPosition = SavedPositions.Pop();
 }
 
 void ALightningGenerator::UpdateImGui()
@@ -287,8 +219,27 @@ void ALightningGenerator::UpdateImGui()
 		ImGui::Text("FPS: %.1f", ImGui::GetIO().Framerate);
 		ImGui::Text("Generation time (ms): %.3f", GenerationTime * 1000); // * 1000 to convert to milliseconds
 		ImGui::Text("Render time (ms): %.3f", RenderTime * 1000);
+		ImGui::Text("Time to first segment (ms): %.3f", TimeToFirstSegment * 1000);
 		ImGui::Text("Segment count: %d", NumSegments);
 
+		// What the turtle found in the published bolt's symbols.
+		if (!bIsStreaming && Bolt.IsValid() && !Bolt->bIsPhysics)
+		{
+			const LSymbolAnalysis& analysis = Bolt->Analysis;
+			ImGui::Text("Branch depth: %d, turns: %d right, %d left", analysis.MaxDepth, analysis.NumTurnsRight, analysis.NumTurnsLeft);
+		}
+
+		if (PendingBolt.IsValid())
+		{
+			ImGui::Text("Generating...");
+		}
+
+		// The L system stopped partway through its iterations, so the lightning is smaller than asked for.
+		if (!bIsStreaming && Bolt.IsValid() && Bolt->bIsTruncated)
+		{
+			ImGui::TextColored(ImVec4(1, 0.5f, 0, 1), "L-system budget reached, iterations stopped early");
+		}
+
 		// Slider to scale ImGui window
 		ImGui::SliderFloat("UI Scale", &ImGuiScale, 0.5, 4);
 		ImGui::SetWindowFontScale(ImGuiScale);
@@ -299,10 +250,17 @@ void ALightningGenerator::UpdateImGui()
 			ImGui::Indent();
 
 			// Toggle physics model
-			ImGui::Checkbox("Use physics model?", &bUsePhysicsModel);
+			if (ImGui::Checkbox("Use physics model?", &bUsePhysicsModel))
+			{
+				InvalidatePool();
+				bEstimateDirty = true;
+			}
 
 			// Toggle 3D mode
-			ImGui::Checkbox("3D Mode", &bIs3DEnabled);
+			if (ImGui::Checkbox("3D Mode", &bIs3DEnabled))
+			{
+				Invalidate(LStage_Interpretation);
+			}
 
 			// Toggle auto generating lightning
 			if (ImGui::Checkbox("Auto generate lightning?", &bAutoGenerate))
@@ -337,6 +295,23 @@ void ALightningGenerator::UpdateImGui()
 				}
 			}
 
+			// Seed options. Entering a strike's seed and fixing it will generate that strike again.
+			// Changing the seed of a fixed seed strike expands it again. Either way, the pool's bolts were made from the old seed.
+			if (ImGui::InputInt("Seed", &Seed) | ImGui::Checkbox("Fixed seed", &bUseFixedSeed))
+			{
+				InvalidatePool();
+
+				if (bUseFixedSeed)
+				{
+					Invalidate(LStage_Expansion);
+				}
+			}
+
+			// Number of bolts generated ahead of time, so a strike doesn't wait for its bolt.
+			ImGui::SliderInt("Ready bolts", &PoolDepth, 0, MaxPoolDepth);
+			ImGui::Text("Bolts ready: %d", PoolCount);
+			ImGui::Text("Strike seed: %d", StrikeSeed);
+
 			// Pressing this button destroys the lightning particles.
 			if (ImGui::Button("Destroy particles"))
 			{
@@ -351,37 +326,115 @@ void ALightningGenerator::UpdateImGui()
 		{
 			ImGui::Indent();
 
-			// Re-build rule list, to be pressed when relevant values have been changed.
+			// Each option marks the stage it is used in, and the current lightning is regenerated from that stage.
+			// Lengths and widths are part of parametric rules, so they change the grammar when it is parametric.
+			const ELStage shapeStage = bParametricLSystem ? LStage_Grammar : LStage_Interpretation;
+
+			// Re-build rule list.
 			if (ImGui::Button("Rebuild Rules"))
 			{
-				RebuildRules();
+				Invalidate(LStage_Grammar);
 			}
 
 
 			// Toggle animating lightning
-			ImGui::Checkbox("Animate lightning", &bAnimateLightning);
+			if (ImGui::Checkbox("Animate lightning", &bAnimateLightning))
+			{
+				Invalidate(LStage_Render);
+			}
+
+			// Toggle expanding the string while drawing, rather than building it first
+			if (ImGui::Checkbox("Stream expansion (low memory)", &bStreamLSystem))
+			{
+				Invalidate(LStage_Expansion);
+			}
+
+			// Toggle streaming from a worker thread, so the lightning starts drawing while the rest is generated
+			if (ImGui::Checkbox("Pipelined drawing", &bPipelineLSystem))
+			{
+				Invalidate(LStage_Expansion);
+			}
+
+			// Toggle building rules with length and width parameters
+			if (ImGui::Checkbox("Parametric rules", &bParametricLSystem))
+			{
+				Invalidate(LStage_Grammar);
+			}
 
 			// Toggle using dynamic branch width
-			ImGui::Checkbox("Dynamic branch width", &bDynamicBranchWidth);
+			if (ImGui::Checkbox("Dynamic branch width", &bDynamicBranchWidth))
+			{
+				Invalidate(LStage_Interpretation);
+			}
 
 			// If not using dynamic branch width, you can set fixed multiplier here.
 			if (!bDynamicBranchWidth)
 			{
-				ImGui::SliderFloat("Branch width multiplier", &BranchWidthMultiplier, 0, 1);
+				if (ImGui::SliderFloat("Branch width multiplier", &BranchWidthMultiplier, 0, 1))
+				{
+					Invalidate(shapeStage);
+				}
 			}
 
 			// Sliders for L-system properties
-			ImGui::SliderInt("Iterations", &Iterations, 1, 10);
-			ImGui::SliderFloat("Branch chance (requires rules rebuild)", &BranchChance, 0, 1);
-			ImGui::SliderFloat("Segment turn chance (requires rules rebuild)", &TurnChance, 0, 1);
-			ImGui::SliderFloat("Min segment length", &MinSegmentLength, 1, 100);
-			ImGui::SliderFloat("Max segment length", &MaxSegmentLength, 1, 100);
-			ImGui::SliderFloat("Min branching angle", &MinAngleBranch, 0, 90);
-			ImGui::SliderFloat("Max branching angle", &MaxAngleBranch, 0, 90);
-			ImGui::SliderFloat("Min turning angle", &MinAngleTurning, 0, 90);
-			ImGui::SliderFloat("Max turning angle", &MaxAngleTurning, 0, 90);
-			ImGui::SliderFloat("Leader width", &MaxWidth, 1, 20);
-			ImGui::SliderFloat("L-system jitter amount", &LSystemJitter, 0.05, 3);
+			if (ImGui::SliderInt("Iterations", &Iterations, 1, 10))
+			{
+				Invalidate(LStage_Expansion);
+			}
+
+			// Budget for the string. Iterations stop once it is reached.
+			if (ImGui::SliderInt("Symbol limit (0 for none)", &MaxSymbols, 0, 100000000) | ImGui::SliderInt("Memory limit (MB, 0 for none)", &MaxMemoryMB, 0, 4096))
+			{
+				Invalidate(LStage_Expansion);
+			}
+
+			// Limit on segments drawn. The deepest branches are left out until the rest fit.
+			if (ImGui::SliderInt("Drawn segment limit (0 for none)", &MaxDrawnSegments, 0, 100000))
+			{
+				Invalidate(LStage_Render);
+			}
+
+			if (ImGui::Checkbox("Pack symbols (low memory)", &bPackSymbols))
+			{
+				Invalidate(LStage_Expansion);
+			}
+
+			// Toggle sharing the expansion of repeated symbols, and how many different expansions each symbol can have
+			if (ImGui::Checkbox("Share repeated subtrees", &bShareSubtrees))
+			{
+				Invalidate(LStage_Expansion);
+			}
+
+			if (bShareSubtrees && ImGui::SliderInt("Subtree variants", &SubtreeVariants, 1, 256))
+			{
+				Invalidate(LStage_Expansion);
+			}
+
+			if (ImGui::SliderFloat("Branch chance##LSystem", &BranchChance, 0, 1) | ImGui::SliderFloat("Segment turn chance##LSystem", &TurnChance, 0, 1))
+			{
+				Invalidate(LStage_Grammar);
+			}
+
+			if (ImGui::SliderFloat("Min segment length", &MinSegmentLength, 1, 100) | ImGui::SliderFloat("Max segment length", &MaxSegmentLength, 1, 100))
+			{
+				Invalidate(shapeStage);
+			}
+
+			if (ImGui::SliderFloat("Min branching angle", &MinAngleBranch, 0, 90) | ImGui::SliderFloat("Max branching angle", &MaxAngleBranch, 0, 90) |
+				ImGui::SliderFloat("Min turning angle", &MinAngleTurning, 0, 90) | ImGui::SliderFloat("Max turning angle", &MaxAngleTurning, 0, 90))
+			{
+				Invalidate(LStage_Interpretation);
+			}
+
+			if (ImGui::SliderFloat("Leader width", &MaxWidth, 1, 20))
+			{
+				Invalidate(shapeStage);
+			}
+
+			if (ImGui::SliderFloat("L-system jitter amount", &LSystemJitter, 0.05, 3))
+			{
+				Invalidate(LStage_Render);
+			}
 
 			ImGui::Unindent();
 		}
@@ -391,37 +444,50 @@ void ALightningGenerator::UpdateImGui()
 		{
 			ImGui::Indent();
 
+			// Physics properties are read when a bolt is generated, so ready bolts are thrown away when any of them change.
+			bool bChanged = false;
+
 			// Toggles a bug fix, intended only for use in the packaged build
-			ImGui::Checkbox("Packeged Build Behaviour Fix", &PModel.bPackagedBuildFix);
+			bChanged |= ImGui::Checkbox("Packeged Build Behaviour Fix", &PModel.bPackagedBuildFix);
 
 			// If true, doesn't spawn the first segment particle
 			ImGui::Checkbox("Hide first segment?", &bHideFirstSegment);
 
 			// Toggles segment limit
-			ImGui::Checkbox("Use segment limit?", &PModel.bUseSegmentLimit);
+			bChanged |= ImGui::Checkbox("Use segment limit?", &PModel.bUseSegmentLimit);
 
-			// If segment limit is enabled, set the limit here
-			if (PModel.bUseSegmentLimit)
+			// If segment limit is enabled, set the limit here. An auto-tuned limit can be far past the slider's range, so it is only shown.
+			if (PModel.bUseSegmentLimit && bAutoTuneCost)
 			{
-				ImGui::SliderInt("Segment limit", &PModel.MaxSegments, 0, 128);
+				ImGui::Text("Segment limit (auto-tuned): %d", PModel.MaxSegments);
+			}
+			else if (PModel.bUseSegmentLimit)
+			{
+				bChanged |= ImGui::SliderInt("Segment limit", &PModel.MaxSegments, 0, 128);
 			}
 
 			// Sliders for physics model properties
-			ImGui::SliderFloat("Scale", &PModel.Scale, 0, 50);
-			ImGui::SliderFloat("Branch chance", &PModel.BranchChance, 0, 1);
-			ImGui::SliderFloat("Voltage", &PModel.Voltage, 10000000, 500000000);
-			ImGui::SliderFloat("Pressure multiplier", &PModel.PressureMultiplier, 0.1, 5.0);
-			ImGui::SliderFloat("Constant A", &PModel.ConstantA, 0.01, 1);
-			ImGui::SliderFloat("Constant A Deviation", &PModel.ConstantADeviation, 0, 1);
-			ImGui::SliderFloat("Temperature at sea level (Kelvin)", &PModel.SeaLevelTemp, 273, 500);
-			ImGui::SliderFloat("Start height", &PModel.StartHeight, 0, 5000);
-			ImGui::SliderFloat("Base length", &PModel.Length, 0, 50);
-			ImGui::SliderFloat("Base length deviation", &PModel.LengthDeviation, 0, 50);
-			ImGui::SliderFloat("Branching angle", &PModel.Angle, 0, 90);
-			ImGui::SliderFloat("Branching angle deviation", &PModel.AngleDeviation, 0, 90);
-			ImGui::SliderFloat("Initial angle range", &PModel.InitialAngleRange, 0, 45);
+			bChanged |= ImGui::SliderFloat("Scale", &PModel.Scale, 0, 50);
+			bChanged |= ImGui::SliderFloat("Branch chance", &PModel.BranchChance, 0, 1);
+			bChanged |= ImGui::SliderFloat("Voltage", &PModel.Voltage, 10000000, 500000000);
+			bChanged |= ImGui::SliderFloat("Pressure multiplier", &PModel.PressureMultiplier, 0.1, 5.0);
+			bChanged |= ImGui::SliderFloat("Constant A", &PModel.ConstantA, 0.01, 1);
+			bChanged |= ImGui::SliderFloat("Constant A Deviation", &PModel.ConstantADeviation, 0, 1);
+			bChanged |= ImGui::SliderFloat("Temperature at sea level (Kelvin)", &PModel.SeaLevelTemp, 273, 500);
+			bChanged |= ImGui::SliderFloat("Start height", &PModel.StartHeight, 0, 5000);
+			bChanged |= ImGui::SliderFloat("Base length", &PModel.Length, 0, 50);
+			bChanged |= ImGui::SliderFloat("Base length deviation", &PModel.LengthDeviation, 0, 50);
+			bChanged |= ImGui::SliderFloat("Branching angle", &PModel.Angle, 0, 90);
+			bChanged |= ImGui::SliderFloat("Branching angle deviation", &PModel.AngleDeviation, 0, 90);
+			bChanged |= ImGui::SliderFloat("Initial angle range", &PModel.InitialAngleRange, 0, 45);
 			ImGui::SliderFloat("Model jitter amount", &PModelJitter, 0.05, 3);
 
+			if (bChanged)
+			{
+				InvalidatePool();
+				bEstimateDirty = true;
+			}
+
 			ImGui::Unindent();
 		}
 
@@ -431,11 +497,17 @@ void ALightningGenerator::UpdateImGui()
 			ImGui::Indent();
 
 			// Particle sliders
-			ImGui::SliderInt("Particle count", &ParticleCount, 1, 20);
-			ImGui::SliderFloat("Particle lifespan", &ParticleLifespan, 0.1, 30);
+			// Shader options only change how the segments are drawn, so the current lightning is drawn again with them.
+			if (ImGui::SliderInt("Particle count", &ParticleCount, 1, 20) | ImGui::SliderFloat("Particle lifespan", &ParticleLifespan, 0.1, 30))
+			{
+				Invalidate(LStage_Render);
+			}
 
 			// Intensity of colour - the higher, the brighter
-			ImGui::SliderFloat("Intensity", &ColorIntensity, 1, 1000);
+			if (ImGui::SliderFloat("Intensity", &ColorIntensity, 1, 1000))
+			{
+				Invalidate(LStage_Render);
+			}
 
 			// Colour picker
 			// *** //
@@ -445,7 +517,10 @@ void ALightningGenerator::UpdateImGui()
 			color[2] = LightningColor.B;
 			color[3] = LightningColor.A;
 
-			ImGui::ColorPicker4("Colour", color);
+			if (ImGui::ColorPicker4("Colour", color))
+			{
+				Invalidate(LStage_Render);
+			}
 
 			LightningColor = { color[0], color[1], color[2], color[3] };
 			// *** //
@@ -453,6 +528,39 @@ void ALightningGenerator::UpdateImGui()
 			ImGui::Unindent();
 		}
 
+		// Predicted cost of the next strike
+		if (ImGui::CollapsingHeader("Cost Estimate"))
+		{
+			ImGui::Indent();
+
+			ImGui::Text("Expected segments: %.0f", Estimate.Segments);
+			ImGui::Text("Expected memory (MB): %.2f", Estimate.MemoryBytes / (1024.0 * 1024.0));
+			ImGui::Text("Expected generation time (ms): %.3f", Estimate.Milliseconds);
+
+			if (Estimate.bIsPhysics && bAutoTuneCost && !PModel.bUseSegmentLimit)
+			{
+				ImGui::Text("Enable the segment limit to auto-tune it");
+			}
+
+			if (!Estimate.bIsPhysics)
+			{
+				ImGui::Text("Growth per iteration: %.2f", Estimate.GrowthRate);
+
+				if (Estimate.bIsTruncated)
+				{
+					ImGui::TextColored(ImVec4(1, 0.5f, 0, 1), "Expected to reach the symbol limit");
+				}
+			}
+
+			// Toggle fitting the iterations or segment limit to the budget
+			if (ImGui::Checkbox("Auto-tune to budget", &bAutoTuneCost) | ImGui::SliderFloat("Strike budget (ms)", &StrikeBudgetMs, 1, 1000))
+			{
+				bEstimateDirty = true;
+			}
+
+			ImGui::Unindent();
+		}
+
 		if (ImGui::CollapsingHeader("Testing"))
 		{
 			ImGui::Indent();
@@ -465,6 +573,32 @@ void ALightningGenerator::UpdateImGui()
 			ImGui::Text("100 spawns time (ms): %.3f", Spawn100Times * 1000); // * 1000 to convert to milliseconds
 			ImGui::Text("100 renders time (ms): %.3f", Render100Times * 1000);
 
+			if (ImGui::Button("Benchmark rewriting"))
+			{
+				BenchmarkRewriting();
+			}
+
+			// Throughput for each core count, and the speedup compared to a single core.
+			for (int i = 0; i < RewriteThroughput.Num(); i++)
+			{
+				ImGui::Text("%d cores: %.2f M symbols/s (%.2fx)", i + 1, RewriteThroughput[i], RewriteThroughput[i] / RewriteThroughput[0]);
+			}
+
+			if (ImGui::Button("Benchmark random numbers"))
+			{
+				BenchmarkRandom();
+			}
+
+			ImGui::Text("10 iteration L-system random (ms): %.3f per call, %.3f block (%.2fx)", GrammarRandomTimes[0] * 1000, GrammarRandomTimes[1] * 1000, GrammarRandomTimes[0] / FMath::Max(GrammarRandomTimes[1], 1e-9f));
+			ImGui::Text("500 segment physics random (ms): %.3f per call, %.3f block (%.2fx)", PhysicsRandomTimes[0] * 1000, PhysicsRandomTimes[1] * 1000, PhysicsRandomTimes[0] / FMath::Max(PhysicsRandomTimes[1], 1e-9f));
+
+			if (ImGui::Button("Benchmark turtle"))
+			{
+				BenchmarkTurtle();
+			}
+
+			ImGui::Text("Turtle: %.2f M symbols/s on 1 core, %.2f on all cores (%.2fx)", TurtleThroughput[0], TurtleThroughput[1], TurtleThroughput[1] / FMath::Max(TurtleThroughput[0], 1e-9f));
+
 			ImGui::Unindent();
 		}
 
@@ -472,26 +606,59 @@ void ALightningGenerator::UpdateImGui()
 	}
 }
 
+// Rules are added straight to the builder, so no weights are rounded. Parametric rules are formatted with every significant digit of their floats into stack buffers, so neither kind of rule allocates once the builder has grown.
 void ALightningGenerator::RebuildRules()
 {
-	// Empty current rule list.
-	Rules.Empty();
+	// Empty current rule list, keeping its memory.
+	Rules.Reset();
 
-	// Create rules using relative values.
-	FString rule1 = "F => F (" + FString::SanitizeFloat(1 - BranchChance) + ")";
-	FString rule2 = "F => F[+F] (" + FString::SanitizeFloat(BranchChance / 2) + ")";
-	FString rule3 = "F => F[-F] (" + FString::SanitizeFloat(BranchChance / 2) + ")";
-	FString rule4 = "F => FF (" + FString::SanitizeFloat(1 - TurnChance) + ")";
-	FString rule5 = "F => F+F (" + FString::SanitizeFloat(TurnChance / 2) + ")";
-	FString rule6 = "F => F-F (" + FString::SanitizeFloat(TurnChance / 2) + ")";
-	
-	// Add rules to array.
-	Rules.Add(rule1);
-	Rules.Add(rule2);
-	Rules.Add(rule3);
-	Rules.Add(rule4);
-	Rules.Add(rule5);
-	Rules.Add(rule6);
+	// Parametric rules give each segment a random length, and scale the width of new branches. The parameters are l (length) and w (width).
+	if (bParametricLSystem)
+	{
+		TStringBuilder<128> segment;
+		TStringBuilder<128> branch;
+		TStringBuilder<128> axiom;
+		segment.Appendf(TEXT("F(rand(%.9g,%.9g),w)"), MinSegmentLength, MaxSegmentLength);
+		branch.Appendf(TEXT("F(rand(%.9g,%.9g),w*%.9g)"), MinSegmentLength, MaxSegmentLength, BranchWidthMultiplier);
+		axiom.Appendf(TEXT("F(%.9g,%.9g)"), (MinSegmentLength + MaxSegmentLength) / 2, MaxWidth);
+
+		Rules.SetAxiom(axiom.ToView());
+
+		TStringBuilder<512> successor;
+		auto addRule = [this, &successor](float weight)
+		{
+			Rules.AddRule(TEXT("F(l,w)"), successor.ToView(), weight);
+			successor.Reset();
+		};
+
+		successor << segment.ToView();
+		addRule(1 - BranchChance);
+		successor << segment.ToView() << TEXT("[+") << branch.ToView() << TEXT("]");
+		addRule(BranchChance / 2);
+		successor << segment.ToView() << TEXT("[-") << branch.ToView() << TEXT("]");
+		addRule(BranchChance / 2);
+		successor << segment.ToView() << segment.ToView();
+		addRule(1 - TurnChance);
+		successor << segment.ToView() << TEXT("+") << segment.ToView();
+		addRule(TurnChance / 2);
+		successor << segment.ToView() << TEXT("-") << segment.ToView();
+		addRule(TurnChance / 2);
+	}
+	else
+	{
+		Rules.SetAxiom(TEXT("F"));
+
+		// Create rules using relative values.
+		Rules.AddRule(TEXT("F"), TEXT("F"), 1 - BranchChance);
+		Rules.AddRule(TEXT("F"), TEXT("F[+F]"), BranchChance / 2);
+		Rules.AddRule(TEXT("F"), TEXT("F[-F]"), BranchChance / 2);
+		Rules.AddRule(TEXT("F"), TEXT("FF"), 1 - TurnChance);
+		Rules.AddRule(TEXT("F"), TEXT("F+F"), TurnChance / 2);
+		Rules.AddRule(TEXT("F"), TEXT("F-F"), TurnChance / 2);
+	}
+
+	// Both sets of rules replace F, so their weights are normalized together.
+	Rules.Normalize();
 }
 
 void ALightningGenerator::DestroyParticles()
@@ -514,46 +681,385 @@ void ALightningGenerator::DestroyParticles()
 	}
 }
 
-// Function for spawning lightning.
+// Function for spawning lightning. The next bolt is taken from the pool if one is ready, otherwise it is drawn from a later tick once it has been generated.
 void ALightningGenerator::SpawnLightning()
 {
-	// Start time for calculating generation time.
-	double start = FPlatformTime::Seconds();
+	// Changes that haven't been regenerated yet are used by the new strike instead.
+	if (DirtyStage <= LStage_Grammar)
+	{
+		RebuildRules();
+	}
+	DirtyStage = LStage_Count;
 
-	// If true, use physics method to generate lightning. If false, use L-system method.
-	if (bUsePhysicsModel)
+	DrawPosition = FVector(0, 0, 2000);
+	LightningDirection = FVector(0, 0, -1);
+
+	SpawnTime = FPlatformTime::Seconds();
+	bAwaitingFirstSegment = true;
+
+	// Streamed strikes are expanded while they are drawn, so don't need a bolt.
+	if (CanStream())
 	{
-		PModel.GenerateSegments();
+		StrikeSeed = NextStrikeSeed();
+		StartStream(false);
+		return;
+	}
+
+	if (PoolCount > 0)
+	{
+		TSharedRef<const LBolt> bolt = BoltPool[PoolHead].ToSharedRef();
+		BoltPool[PoolHead].Reset();
+		PoolHead = (PoolHead + 1) % MaxPoolDepth;
+		PoolCount--;
+
+		PublishBolt(bolt, false);
 	}
 	else
 	{
-		DrawPosition = FVector(0, 0, 2000);
-		System.Build(Axiom, Rules, Iterations);
+		bSpawnWaiting = true;
 	}
 
-	// Format the L system's string for drawing.
-	ReverseCharArray = System.GetResult().Reverse().GetCharArray();
-	
-	// Set default values for drawing L-system.
+	FillPool();
+}
+
+// Get the seed for a strike. Unless the seed is fixed, each strike's seed comes from the generator's seed and the number of strikes, so every strike can be reproduced.
+int32 ALightningGenerator::NextStrikeSeed()
+{
+	return bUseFixedSeed ? Seed : (int32)LRandom::Hash((uint32)Seed, StrikeCount++, 0);
+}
+
+// Streaming only compiles the grammar, and the string is expanded as it is drawn, so it doesn't need a worker thread.
+bool ALightningGenerator::CanStream()
+{
+	if (bUsePhysicsModel || !(bStreamLSystem || bPipelineLSystem))
+	{
+		return false;
+	}
+
+	System.Prepare(Rules);
+
+	// Rules with more than one symbol or with context need the symbols around them, and the streaming expander and turtle don't read module parameters, so these grammars are always built.
+	return !System.GetGrammar().HasPatterns() && !System.GetGrammar().IsParametric();
+}
+
+void ALightningGenerator::StartStream(bool bReplace)
+{
+	if (bReplace)
+	{
+		DestroyParticles();
+	}
+
+	StopPipeline();
+
+	bIsStreaming = true;
+	bHasLSystemStrike = true;
+	Segments.Reset();
+
+	// A pipelined strike is expanded by a task from a snapshot of the properties, the same as a bolt.
+	if (bPipelineLSystem)
+	{
+		bIsPipelined = true;
+		SegmentStream->Reset();
+		StreamTask = UE::Tasks::Launch(UE_SOURCE_LOCATION, [stream = SegmentStream, request = MakeBoltRequest(LStage_Grammar, StrikeSeed)]()
+		{
+			stream->Produce(request);
+		});
+	}
+	else
+	{
+		StreamExpander.Begin(&System.GetGrammar(), Iterations, StrikeSeed);
+		Turtle.Begin(GetTurtleSettings(), StrikeSeed);
+	}
+
+	// Streamed segments are counted as they are drawn.
+	NumSegments = 0;
 	SegmentsDrawn = 0;
-	LightningDirection = FVector(0, 0, -1);
+	SegmentCursor = 0;
+	GenerationTime = 0.0f;
+	bIsDrawing = true;
+}
 
-	// Count the number of segments that were generated based on the model.
-	if (bUsePhysicsModel)
+// The producer stops at its next segment, so this only waits for a moment.
+void ALightningGenerator::StopPipeline()
+{
+	if (StreamTask.IsValid())
+	{
+		SegmentStream->Cancel();
+		StreamTask.Wait();
+		StreamTask = UE::Tasks::TTask<void>();
+	}
+
+	bIsPipelined = false;
+}
+
+// Only one bolt is generated at a time, as the builder keeps its L system between bolts. Requests made in the meantime are merged, so only the latest properties are generated.
+void ALightningGenerator::RequestBolt(ELStage firstStage, bool bReplace)
+{
+	bReplaceOnPublish |= bReplace;
+
+	if (PendingBolt.IsValid())
+	{
+		QueuedStage = FMath::Min(QueuedStage, firstStage);
+		return;
+	}
+
+	LaunchBolt(MakeBoltRequest(firstStage, StrikeSeed), false);
+}
+
+LBoltRequest ALightningGenerator::MakeBoltRequest(ELStage firstStage, int32 seed) const
+{
+	LBoltRequest request;
+	request.FirstStage = firstStage;
+	request.Seed = seed;
+	request.bUsePhysicsModel = bUsePhysicsModel;
+	request.PModel = PModel;
+	request.PModel.Set3DMode(bIs3DEnabled);
+	request.Rules = Rules;
+	request.Iterations = Iterations;
+	request.MaxSymbols = MaxSymbols;
+	request.MaxBytes = (int64)MaxMemoryMB * 1024 * 1024;
+	request.bPackSymbols = bPackSymbols;
+	request.bShareSubtrees = bShareSubtrees;
+	request.SubtreeVariants = SubtreeVariants;
+	request.TurtleSettings = GetTurtleSettings();
+
+	// Bolts that only interpret symbols again do less work than estimated, and an estimate waiting to be updated is for older properties, so neither is compared.
+	if (!bEstimateDirty && firstStage < LStage_Interpretation)
+	{
+		request.Estimate = Estimate;
+	}
+
+	return request;
+}
+
+void ALightningGenerator::LaunchBolt(LBoltRequest&& request, bool bForPool)
+{
+	bPendingForPool = bForPool;
+	PendingPoolVersion = PoolVersion;
+
+	// Only one bolt is generated at a time, so the two builders are never used at once.
+	TSharedRef<LBoltBuilder> builder = bForPool ? PoolBuilder : BoltBuilder;
+
+	PendingBolt = UE::Tasks::Launch(UE_SOURCE_LOCATION, [builder, request = MoveTemp(request)]()
+	{
+		return builder->Build(request);
+	});
+}
+
+// Pool bolts go to a strike that is waiting for one, or into the pool if it hasn't been invalidated since they were requested.
+void ALightningGenerator::ReceiveBolt()
+{
+	TSharedRef<const LBolt> bolt = PendingBolt.GetResult();
+	PendingBolt = UE::Tasks::TTask<TSharedRef<const LBolt>>();
+
+	// Each bolt's time teaches the estimator how long its work takes on this machine. It is compared against the estimate made when it was requested, as pool bolts can be from older properties.
+	// The learned cost is used from the next change of properties, so auto-tuning doesn't regenerate after every strike.
+	if (bolt->bIsPhysics == bolt->Estimate.bIsPhysics)
+	{
+		Estimator.Observe(bolt->Estimate, bolt->Num(), bolt->GenerationTime);
+	}
+
+	if (!bPendingForPool)
+	{
+		const bool bReplace = bReplaceOnPublish;
+		bReplaceOnPublish = false;
+		PublishBolt(bolt, bReplace);
+	}
+	else if (PendingPoolVersion == PoolVersion)
 	{
-		NumSegments = PModel.GetSegments().Num();
+		if (bSpawnWaiting)
+		{
+			bSpawnWaiting = false;
+			PublishBolt(bolt, false);
+		}
+		else
+		{
+			BoltPool[(PoolHead + PoolCount) % MaxPoolDepth] = bolt;
+			PoolCount++;
+		}
+	}
+
+	// Start the request that was waiting, now that the builder is free, otherwise carry on filling the pool.
+	if (QueuedStage != LStage_Count)
+	{
+		const ELStage stage = QueuedStage;
+		QueuedStage = LStage_Count;
+		LaunchBolt(MakeBoltRequest(stage, StrikeSeed), false);
 	}
 	else
 	{
-		NumSegments = CountSegments();
+		FillPool();
 	}
-	
+}
+
+// The new bolt replaces the one being drawn. A replacing bolt destroys the lightning that was drawn, otherwise it is left to fade out.
+void ALightningGenerator::PublishBolt(const TSharedRef<const LBolt>& bolt, bool bReplace)
+{
+	if (bReplace)
+	{
+		DestroyParticles();
+	}
+
+	StopPipeline();
+
+	Bolt = bolt;
+	StrikeSeed = bolt->Seed;
+	bHasLSystemStrike = !bolt->bIsPhysics;
+	bIsStreaming = false;
+	NumSegments = bolt->Num();
+	GenerationTime = bolt->GenerationTime;
+	UpdateDrawDepth();
+
+	// Set default values for drawing.
+	SegmentsDrawn = 0;
+	SegmentCursor = 0;
+
 	// Set drawing to true so lightning draws in tick function.
 	bIsDrawing = true;
+}
 
-	// End time and calculate how long it took to generate.
-	double end = FPlatformTime::Seconds();
-	GenerationTime = end - start;
+// The main branch is always drawn, even if it alone is over the limit.
+void ALightningGenerator::UpdateDrawDepth()
+{
+	DrawDepth = MAX_int32;
+
+	if (MaxDrawnSegments > 0 && Bolt.IsValid() && !Bolt->bIsPhysics)
+	{
+		DrawDepth = FMath::Max(Bolt->Analysis.GetDepthWithin(MaxDrawnSegments), 0);
+	}
+}
+
+// Streamed and pipelined strikes don't use bolts, so the pool is left empty while either is enabled. A strike waiting for a bolt is always given one.
+void ALightningGenerator::FillPool()
+{
+	if (PendingBolt.IsValid())
+	{
+		return;
+	}
+
+	const bool bPoolFull = PoolCount >= FMath::Clamp(PoolDepth, 0, MaxPoolDepth) || (!bUsePhysicsModel && (bStreamLSystem || bPipelineLSystem));
+
+	if (bPoolFull && !bSpawnWaiting)
+	{
+		return;
+	}
+
+	LaunchBolt(MakeBoltRequest(LStage_Grammar, NextStrikeSeed()), true);
+}
+
+void ALightningGenerator::InvalidatePool()
+{
+	for (TSharedPtr<const LBolt>& bolt : BoltPool)
+	{
+		bolt.Reset();
+	}
+
+	PoolHead = 0;
+	PoolCount = 0;
+	PoolVersion++;
+}
+
+// The grammar is compiled on the game thread to read its probabilities, which is quick once the rules are cached.
+void ALightningGenerator::UpdateEstimate()
+{
+	bEstimateDirty = false;
+
+	if (bUsePhysicsModel)
+	{
+		// Only a limit the user has enabled is tuned.
+		if (bAutoTuneCost && StrikeBudgetMs > 0.0f && PModel.bUseSegmentLimit)
+		{
+			const int32 segments = Estimator.FitPhysicsSegments(StrikeBudgetMs);
+
+			if (PModel.MaxSegments != segments)
+			{
+				PModel.MaxSegments = segments;
+				InvalidatePool();
+			}
+		}
+
+		Estimate = Estimator.EstimatePhysics(PModel);
+		return;
+	}
+
+	if (DirtyStage <= LStage_Grammar)
+	{
+		RebuildRules();
+	}
+
+	System.Prepare(Rules);
+	const LGrammar& grammar = System.GetGrammar();
+
+	if (bAutoTuneCost && StrikeBudgetMs > 0.0f)
+	{
+		const int32 iterations = Estimator.FitIterations(grammar, 10, MaxSymbols, bPackSymbols, StrikeBudgetMs, (double)MaxMemoryMB * 1024 * 1024);
+
+		if (iterations != Iterations)
+		{
+			Iterations = iterations;
+			Invalidate(LStage_Expansion);
+		}
+	}
+
+	Estimate = Estimator.EstimateLSystem(grammar, Iterations, MaxSymbols, bPackSymbols);
+}
+
+// Anything before rendering changes the bolts, so the pool is made with the old properties.
+void ALightningGenerator::Invalidate(ELStage stage)
+{
+	DirtyStage = FMath::Min(DirtyStage, stage);
+
+	if (stage < LStage_Render)
+	{
+		InvalidatePool();
+		bEstimateDirty = true;
+	}
+}
+
+// Runs the stages from the earliest one that has changed. The grammar, symbols and segments of the current strike are kept between stages, so a change to how the lightning is drawn doesn't need the string to be rewritten.
+void ALightningGenerator::Regenerate()
+{
+	const ELStage stage = DirtyStage;
+	DirtyStage = LStage_Count;
+
+	// The rules are always rebuilt, so the next strike uses them even if the current one can't be regenerated.
+	if (stage <= LStage_Grammar)
+	{
+		RebuildRules();
+	}
+
+	// Physics lightning is only generated in full, so changes are used by the next strike.
+	if (!bHasLSystemStrike || bUsePhysicsModel)
+	{
+		return;
+	}
+
+	// A fixed seed can be changed for the current strike.
+	if (stage <= LStage_Expansion && bUseFixedSeed)
+	{
+		StrikeSeed = Seed;
+	}
+
+	// The published bolt is drawn again as it is. Streamed strikes don't keep their symbols, so are expanded again from the start whatever has changed.
+	if (stage == LStage_Render && !bIsStreaming && Bolt.IsValid())
+	{
+		DestroyParticles();
+		UpdateDrawDepth();
+		SegmentsDrawn = 0;
+		SegmentCursor = 0;
+		bIsDrawing = true;
+		return;
+	}
+
+	// The builder keeps the symbols of the last bolt, so it only expands them again if the expansion has changed.
+	if (CanStream())
+	{
+		StartStream(true);
+	}
+	else
+	{
+		RequestBolt(FMath::Min(stage, LStage_Interpretation), true);
+	}
 }
 
 void ALightningGenerator::Test100Times()
@@ -563,8 +1069,14 @@ void ALightningGenerator::Test100Times()
 
 	for (int i = 0; i < 100; i++)
 	{
+		// The test waits for the strike's bolt rather than drawing it on a later tick. When the pool has bolts ready, this times taking one from it.
 		double start = FPlatformTime::Seconds();
 		SpawnLightning();
+		while (bSpawnWaiting && PendingBolt.IsValid())
+		{
+			PendingBolt.Wait();
+			ReceiveBolt();
+		}
 		double end = FPlatformTime::Seconds();
 		Spawn100Times += end - start;
 
@@ -577,6 +1089,133 @@ void ALightningGenerator::Test100Times()
 	}
 }
 
+void ALightningGenerator::BenchmarkRewriting()
+{
+	RewriteThroughput.Empty();
+
+	// A separate grammar is used so the current lightning isn't affected. The seed is fixed so each core count rewrites the same string.
+	LGrammar grammar;
+	int32 seed = StrikeSeed;
+	int32 maxWorkers = FTaskGraphInterface::Get().GetNumWorkerThreads() + 1;
+
+	for (int32 workers = 1; workers <= maxWorkers; workers++)
+	{
+		grammar.SetRules(Rules);
+		grammar.SetSeed(seed);
+		grammar.SetMaxWorkers(workers);
+
+		double start = FPlatformTime::Seconds();
+		grammar.Iterate(Iterations);
+		double end = FPlatformTime::Seconds();
+
+		RewriteThroughput.Add(grammar.GetSymbolsRewritten() / FMath::Max(end - start, 1e-9) / 1000000.0);
+	}
+}
+
+void ALightningGenerator::BenchmarkRandom()
+{
+	// The L-system takes a random number for every symbol it rewrites, so count the symbols in a 10 iteration build of the current rules.
+	LGrammar grammar(Rules);
+	grammar.SetSeed(StrikeSeed);
+	grammar.Iterate(10);
+	const int64 grammarNumbers = grammar.GetSymbolsRewritten();
+
+	// Each physics segment takes a normally distributed length and angle, and uniform numbers for the angle offset, angle flip and branch chance.
+	const int32 physicsSegments = 500;
+
+	// The sums are displayed in the log so the compiler can't remove the work being timed.
+	float sum = 0;
+
+	// One call per number, as the L-system and physics model did before.
+	// *** //
+	std::default_random_engine engine(StrikeSeed);
+	double start = FPlatformTime::Seconds();
+	for (int64 i = 0; i < grammarNumbers; i++)
+	{
+		sum += FMath::FRand();
+	}
+	double end = FPlatformTime::Seconds();
+	GrammarRandomTimes[0] = end - start;
+
+	start = FPlatformTime::Seconds();
+	std::normal_distribution<float> lenDistribution(PModel.Length, PModel.LengthDeviation);
+	std::normal_distribution<float> angleDistribution(PModel.Angle, PModel.AngleDeviation);
+	for (int32 i = 0; i < physicsSegments; i++)
+	{
+		sum += lenDistribution(engine) + angleDistribution(engine);
+		sum += FMath::FRandRange(-1.0f, 1.0f) + FMath::RandBool() + FMath::FRandRange(0.0f, 1.0f);
+	}
+	end = FPlatformTime::Seconds();
+	PhysicsRandomTimes[0] = end - start;
+	// *** //
+
+	// Random blocks.
+	// *** //
+	start = FPlatformTime::Seconds();
+	LRandomBlock block(StrikeSeed, LRandomStream_Grammar);
+	for (int64 i = 0; i < grammarNumbers; i++)
+	{
+		sum += block.FRand();
+	}
+	end = FPlatformTime::Seconds();
+	GrammarRandomTimes[1] = end - start;
+
+	start = FPlatformTime::Seconds();
+	block.Seed(StrikeSeed, LRandomStream_Physics);
+	for (int32 i = 0; i < physicsSegments; i++)
+	{
+		sum += block.Gaussian(PModel.Length, PModel.LengthDeviation) + block.Gaussian(PModel.Angle, PModel.AngleDeviation);
+		sum += block.FRandRange(-1.0f, 1.0f) + block.RandBool() + block.FRand();
+	}
+	end = FPlatformTime::Seconds();
+	PhysicsRandomTimes[1] = end - start;
+	// *** //
+
+	UE_LOG(LogTemp, Log, TEXT("Random benchmark: %lld L-system numbers, %d physics segments (sum %f)"), grammarNumbers, physicsSegments, sum);
+}
+
+void ALightningGenerator::BenchmarkTurtle()
+{
+	// A separate L system, turtle and buffer are used so the current lightning isn't affected. The current symbols are built once and interpreted several times to get a stable time.
+	LSystem system;
+	LTurtle turtle;
+	LSegmentBuffer segments;
+	const int32 runs = 10;
+
+	system.SetPackSymbols(bPackSymbols);
+	system.Build(Rules, Iterations, StrikeSeed);
+	const int64 numSymbols = system.IsParametric() ? system.GetModules().Num() : system.IsPacked() ? system.GetPackedSymbols().Num() : system.GetSymbols().Num();
+
+	// 1 core, then no limit.
+	for (int32 pass = 0; pass < 2; pass++)
+	{
+		turtle.SetMaxWorkers(pass == 0 ? 1 : 0);
+
+		double start = FPlatformTime::Seconds();
+		for (int32 i = 0; i < runs; i++)
+		{
+			segments.Reset();
+			turtle.Begin(GetTurtleSettings(), StrikeSeed);
+
+			if (system.IsParametric())
+			{
+				turtle.Interpret(system.GetModules(), segments);
+			}
+			else if (system.IsPacked())
+			{
+				turtle.Interpret(system.GetPackedSymbols(), segments);
+			}
+			else
+			{
+				turtle.Interpret(system.GetSymbols(), segments);
+			}
+		}
+		double end = FPlatformTime::Seconds();
+
+		TurtleThroughput[pass] = numSymbols * runs / FMath::Max(end - start, 1e-9) / 1000000.0;
+	}
+}
+
 // Called every frame
 void ALightningGenerator::Tick(float DeltaTime)
 {
@@ -584,6 +1223,28 @@ void ALightningGenerator::Tick(float DeltaTime)
 
 	// Update user interface.
 	UpdateImGui();
+
+	// The estimate is updated first, so properties auto-tuned from it are used by the regenerated strike.
+	if (bEstimateDirty)
+	{
+		UpdateEstimate();
+	}
+
+	// Run any stages that were changed through the user interface.
+	if (DirtyStage != LStage_Count)
+	{
+		Regenerate();
+	}
+
+	// Start drawing or pool a bolt once it has finished generating, and keep the pool topped up.
+	if (PendingBolt.IsValid() && PendingBolt.IsCompleted())
+	{
+		ReceiveBolt();
+	}
+	else
+	{
+		FillPool();
+	}
 	
 	Render();
 }
@@ -596,18 +1257,18 @@ void ALightningGenerator::Render()
 		// Start time for calculating render time.
 		double start = FPlatformTime::Seconds();
 
-		// If using the physics model...
-		if (bUsePhysicsModel)
+		// If the bolt is from the physics model...
+		if (!bIsStreaming && Bolt->bIsPhysics)
 		{
 			// Get segments.
-			TArray<Segment> segments = PModel.GetSegments();
+			const TArray<Segment>& segments = Bolt->PhysicsSegments;
 
 			if (!segments.IsEmpty())
 			{
 
 				// Iterate through the segments, creating a lightning particle for each of them.
 				float mainSegmentWidth = segments[0].Diameter;
-				for (Segment seg : segments)
+				for (const Segment& seg : segments)
 				{
 					if ((seg.StartPos != segments[0].StartPos && bHideFirstSegment) || !bHideFirstSegment)
 					{
@@ -615,16 +1276,17 @@ void ALightningGenerator::Render()
 						lightningSegment->SetVectorParameter(FName("Start"), seg.StartPos);
 						lightningSegment->SetVectorParameter(FName("End"), seg.EndPos);
 						lightningSegment->SetIntParameter(FName("Particles"), ParticleCount);
-						lightningSegment->SetFloatParameter(FName("MinWidth"), seg.Diameter * PModel.Scale);
-						lightningSegment->SetFloatParameter(FName("MaxWidth"), seg.Diameter * PModel.Scale);
+						lightningSegment->SetFloatParameter(FName("MinWidth"), seg.Diameter * Bolt->PhysicsScale);
+						lightningSegment->SetFloatParameter(FName("MaxWidth"), seg.Diameter * Bolt->PhysicsScale);
 						FLinearColor finalColor = LightningColor * ColorIntensity * (seg.Diameter / mainSegmentWidth);
 						lightningSegment->SetColorParameter(FName("Color"), finalColor);
 						lightningSegment->SetFloatParameter(FName("Lifespan"), ParticleLifespan);
 						lightningSegment->SetFloatParameter(FName("Jitter"), PModelJitter);
-						lightningSegment->SetVectorParameter(FName("SphereScale"), SphereScale * seg.Diameter * PModel.Scale);
+						lightningSegment->SetVectorParameter(FName("SphereScale"), SphereScale * seg.Diameter * Bolt->PhysicsScale);
 						lightningSegment->SetFloatParameter(FName("SphereLifespan"), ParticleLifespan - GetWorld()->GetDeltaSeconds() * SphereLifespanOffset);
 						lightningSegment->SetVectorParameter(FName("SpherePos"), seg.EndPos);
 						SegmentParticles.Add(lightningSegment);
+						MarkSegmentDrawn();
 					}
 				}
 
@@ -649,34 +1311,51 @@ void ALightningGenerator::Render()
 			// While the exit condition is not met...
 			while (!exit)
 			{
-				// If the char array is not empty...
-				if (!ReverseCharArray.IsEmpty())
+				// When pipelined, every segment the worker thread has drawn so far is taken. If it hasn't drawn any more yet, the rest are drawn next frame.
+				if (bIsPipelined && SegmentCursor == Segments.Num())
 				{
-					// Pop the current char from the array.
-					auto currentChar = ReverseCharArray.Pop();
+					Segments.Reset();
+					SegmentCursor = 0;
+
+					const int32 drained = SegmentStream->Drain(Segments, LSegmentRing::Capacity);
+					NumSegments += drained;
 
-					// Decide what to based on the current char.
-					switch (currentChar)
+					if (drained == 0 && !SegmentStream->IsDone())
 					{
-					case 'F': // Draw segment on 'F', increase no. of segments drawn tracker.
-						DrawSegment();
-						SegmentsDrawn++;
-						break;
-					case '+': // Rotate right on '+'.
-						RotateRight();
-						break;
-					case '-': // Rotate left on '-'.
-						RotateLeft();
-						break;
-					case '[': // Save lightning state on '['.
-						Save();
-						break;
-					case ']': // Return to previous lightning state on ']'.
-						Return();
-						break;
-					default:
 						break;
 					}
+				}
+				// When streaming, symbols are expanded and given to the turtle until it draws the next segment. Only that segment is kept, so memory doesn't grow with the length of the string.
+				else if (bIsStreaming && SegmentCursor == Segments.Num())
+				{
+					Segments.Reset();
+					SegmentCursor = 0;
+
+					uint8 symbol;
+					while (Segments.Num() == 0 && StreamExpander.Next(symbol))
+					{
+						Turtle.Step(symbol, Segments);
+					}
+
+					NumSegments += Segments.Num();
+				}
+
+				// Streamed segments are drawn from the turtle's buffer, and the rest from the published bolt.
+				const LSegmentBuffer& segments = bIsStreaming ? Segments : Bolt->Segments;
+
+				// Branches deeper than the draw depth are skipped without counting towards the segments drawn this frame.
+				if (!bIsStreaming && SegmentCursor < segments.Num() && segments.Depths[SegmentCursor] > DrawDepth)
+				{
+					SegmentCursor++;
+					continue;
+				}
+
+				// If there is a segment to draw...
+				if (SegmentCursor < segments.Num())
+				{
+					// Draw the segment, increase no. of segments drawn tracker.
+					DrawSegment(segments, SegmentCursor++);
+					SegmentsDrawn++;
 
 					// Once the required number of segments drawn for this frame has been reached, exit the loop.
 					if (bAnimateLightning)
@@ -690,7 +1369,7 @@ void ALightningGenerator::Render()
 				}
 				else
 				{
-					// Once the char array has been emptied, stop drawing and start the timer for spawning the next lightning strike.
+					// Once every segment has been drawn, or the expander has finished, stop drawing and start the timer for spawning the next lightning strike.
 					exit = true;
 					bIsDrawing = false;
 					if (bAutoGenerate)
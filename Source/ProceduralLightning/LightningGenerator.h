@@ -5,10 +5,17 @@
 #include "CoreMinimal.h"
 #include "GameFramework/Actor.h"
 #include "LSystem.h"
+#include "LStreamExpander.h"
+#include "LTurtle.h"
+#include "LBoltBuilder.h"
+#include "LSegmentStream.h"
+#include "LCostEstimator.h"
+#include "LRandom.h"
 #include "Blueprint/UserWidget.h"
 #include "NiagaraComponent.h"
 #include "NiagaraFunctionLibrary.h"
 #include "PhysicsModel.h"
+#include "Tasks/Task.h"
 #include <random>
 #include <imgui.h>
 #include "LightningGenerator.generated.h"
@@ -38,10 +45,12 @@ protected:
 	// Called when the game starts or when spawned
 	virtual void BeginPlay() override;
 
-	// The L System and its properties.
+	// Called when the game ends or when destroyed. Stops a pipelined strike that is still being generated.
+	virtual void EndPlay(const EEndPlayReason::Type EndPlayReason) override;
+
+	// The L System and its properties. The rules are typed, so rebuilding them doesn't format or parse any numbers.
 	LSystem System;
-	FString Axiom;
-	TArray<FString> Rules;
+	LGrammarBuilder Rules;
 
 	UPROPERTY(BlueprintReadWrite) // Can set no. of iterations via blueprint.
 	int Iterations;
@@ -55,22 +64,17 @@ protected:
 	UPROPERTY(EditAnywhere, BlueprintReadWrite)
 	UNiagaraSystem* LightningTemplate;
 
-	// The direction that the current lightning segment is travelling in.
+	// The direction that the L-system lightning starts travelling in.
 	UPROPERTY(BlueprintReadWrite)
 	FVector LightningDirection;
 
-	// The position of the current lightning segment.
+	// The position that the L-system lightning starts from.
 	UPROPERTY(BlueprintReadWrite)
 	FVector DrawPosition;
 
-	// Unreal arrays for directions and positions, effectively functioning as stacks to be pushed and popped. Used to return to previous positions in the L System generated tree.
-	// *** //
-	UPROPERTY(BlueprintReadWrite)
-	TArray<FVector> SavedDirections;
-
-	UPROPERTY(BlueprintReadWrite)
-	TArray<FVector> SavedPositions;
-	// *** //
+	// The turtle that interprets streamed symbols, and the segments it has drawn.
+	LTurtle Turtle;
+	LSegmentBuffer Segments;
 
 	// Properties of the lightning. These can be changed in blueprint.
 	// *** //
@@ -80,11 +84,12 @@ protected:
 	UPROPERTY(BlueprintReadWrite)
 	int NumSegments;
 
+	// Limits the number of segments drawn by leaving out the deepest branches. Whole depths are left out, so the main branch is always drawn. 0 means no limit.
 	UPROPERTY(BlueprintReadWrite)
-	int SegmentsDrawn;
+	int MaxDrawnSegments;
 
 	UPROPERTY(BlueprintReadWrite)
-	float SegmentLength;
+	int SegmentsDrawn;
 
 	UPROPERTY(BlueprintReadWrite)
 	float MinSegmentLength;
@@ -129,9 +134,57 @@ protected:
 	bool bAnimateLightning;
 	// *** //
 
-	// This is the string generated by the L system, but reversed and separated into a char array. 
-	// This is used for iterating through the lightning segments in the correct order by popping from the end of the array/stack.
-	TArray<TCHAR> ReverseCharArray;
+	// The position of the next segment to draw.
+	int32 SegmentCursor;
+
+	// The deepest branches drawn from the published bolt, from its segments per depth and the limit on segments drawn.
+	int32 DrawDepth;
+
+	// Works out the draw depth of the published bolt.
+	void UpdateDrawDepth();
+
+	// When enabled, the L system's string is never built. Symbols are expanded one at a time as they are drawn, so memory doesn't grow with the number of iterations.
+	UPROPERTY(BlueprintReadWrite)
+	bool bStreamLSystem;
+
+	// Expands the L system while drawing, and whether the lightning being drawn uses it.
+	LStreamExpander StreamExpander;
+	bool bIsStreaming;
+
+	// When enabled, streamed strikes are expanded and interpreted on a worker thread, which passes each segment to the game thread as soon as it is drawn. Takes priority over streaming on the game thread.
+	UPROPERTY(BlueprintReadWrite)
+	bool bPipelineLSystem;
+
+	// Passes segments from the worker thread, and the task producing them. The stream is shared with the task, so it outlives the generator if it is destroyed mid-strike.
+	TSharedRef<LSegmentStream> SegmentStream;
+	UE::Tasks::TTask<void> StreamTask;
+	bool bIsPipelined;
+
+	// Stops the task producing segments, and waits for it to finish.
+	void StopPipeline();
+
+	// Limits on the size of the L system's string, so a high number of iterations can't use all of the memory. 0 means no limit.
+	UPROPERTY(BlueprintReadWrite)
+	int MaxSymbols;
+
+	UPROPERTY(BlueprintReadWrite)
+	int MaxMemoryMB;
+
+	// When enabled, the L system's string is kept with 3 bits per symbol rather than a byte, so longer strings fit in memory.
+	UPROPERTY(BlueprintReadWrite)
+	bool bPackSymbols;
+
+	// When enabled, each symbol is only expanded once for each remaining depth and variant, and every place it appears shares the expansion. More variants give more varied lightning, and fewer give faster generation.
+	UPROPERTY(BlueprintReadWrite)
+	bool bShareSubtrees;
+
+	UPROPERTY(BlueprintReadWrite)
+	int SubtreeVariants;
+
+	// When enabled, the rules are built with parameters for each segment's length and width, which are calculated while the L system is built rather than while drawing.
+	UPROPERTY(BlueprintReadWrite)
+	bool bParametricLSystem;
+
 	
 	// Shader options
 	// *** //
@@ -160,21 +213,117 @@ protected:
 	FVector SphereScale;
 	// *** //
 
-	// Counts the number of segments in the L system's generated string.
-	int CountSegments();
-
 	// Unreal timer handle for spawning lightning, and its associated function that it calls to spawn the lightning.
 	FTimerHandle SpawnTimerHandle;
 	void SpawnLightning();
 
-	// These provide functionality for drawing the lightning generated by the L-system model.
+	// Bolts are generated on a worker thread from a snapshot of the properties, and drawn once they are published. The game thread never waits for one.
+	// *** //
+	// Whether streaming is enabled and the grammar can be streamed. This compiles the grammar if it has changed.
+	bool CanStream();
+
+	// Starts drawing a streamed strike straight away.
+	void StartStream(bool bReplace);
+
+	// Starts generating a bolt for the current strike from a snapshot of the current properties. If a bolt is already being generated, the request waits for it to finish. When replacing, the current lightning is destroyed once the new lightning is ready.
+	void RequestBolt(ELStage firstStage, bool bReplace);
+
+	// Returns a snapshot of the current properties, for a bolt with the seed.
+	LBoltRequest MakeBoltRequest(ELStage firstStage, int32 seed) const;
+
+	// Starts a task that generates a bolt. Only one bolt is generated at a time.
+	void LaunchBolt(LBoltRequest&& request, bool bForPool);
+
+	// Takes the bolt that has finished generating and either draws it or adds it to the pool, then starts the next bolt.
+	void ReceiveBolt();
+
+	// Starts drawing a bolt. Its seed becomes the strike seed.
+	void PublishBolt(const TSharedRef<const LBolt>& bolt, bool bReplace);
+
+	// Generates bolts. These are shared with the task generating a bolt, so they outlive the generator if it is destroyed mid-generation.
+	// Pool bolts have their own builder, so the strike being drawn keeps its expanded symbols for changes that only need it interpreted again.
+	TSharedRef<LBoltBuilder> BoltBuilder;
+	TSharedRef<LBoltBuilder> PoolBuilder;
+
+	// The bolt being generated, if there is one, and whether it is for the pool and which version of the pool.
+	UE::Tasks::TTask<TSharedRef<const LBolt>> PendingBolt;
+	bool bPendingForPool;
+	uint32 PendingPoolVersion;
+
+	// The bolt being drawn, which is never changed once it is published.
+	TSharedPtr<const LBolt> Bolt;
+
+	// The first stage of a request that is waiting for the pending bolt, or LStage_Count if there isn't one, and whether any waiting or pending request replaces the current lightning.
+	ELStage QueuedStage;
+	bool bReplaceOnPublish;
+	// *** //
+
+	// Bolts for the next strikes, generated in the background so spawning a strike only has to take one.
+	// *** //
+	// Generates the next bolt for the pool if it isn't full and nothing else is being generated.
+	void FillPool();
+
+	// Throws away the bolts in the pool, as they were made with properties that have changed. Bolts still being generated for it are thrown away when they finish.
+	void InvalidatePool();
+
+	// Returns the seed for the next strike.
+	int32 NextStrikeSeed();
+
+	// The most bolts the pool can hold.
+	static constexpr int32 MaxPoolDepth = 8;
+
+	// The number of bolts to keep ready, up to MaxPoolDepth. 0 generates each strike when it is spawned.
+	UPROPERTY(BlueprintReadWrite)
+	int PoolDepth;
+
+	// Ring buffer of ready bolts, oldest first from PoolHead.
+	TSharedPtr<const LBolt> BoltPool[MaxPoolDepth];
+	int32 PoolHead;
+	int32 PoolCount;
+
+	// Changed whenever the pool is invalidated, so bolts generated for an older pool can be recognised.
+	uint32 PoolVersion;
+
+	// Whether a strike has been spawned and is waiting for the next pool bolt.
+	bool bSpawnWaiting;
+	// *** //
+
+	// Predicted cost of the next strike, and auto-tuning of its size to fit a budget.
 	// *** //
-	void DrawSegment();
-	void RotateRight();
-	void RotateLeft();
-	void Save(); 
-	void Return();
+	// Estimates the cost of the current properties. When auto-tuning, the iterations or the physics segment limit are changed first to fit the budget.
+	void UpdateEstimate();
+
+	LCostEstimator Estimator;
+	LCostEstimate Estimate;
+
+	// Whether a property has changed since the estimate was made.
+	bool bEstimateDirty;
+
+	// When enabled, the L system's iterations, or the physics model's segment limit if it is enabled, are set to the most that are expected to fit in the budget. The L system also has to fit the memory limit.
+	UPROPERTY(BlueprintReadWrite)
+	bool bAutoTuneCost;
+
+	UPROPERTY(BlueprintReadWrite)
+	float StrikeBudgetMs;
 	// *** //
+
+	// Marks a stage as needing to run again, along with every stage after it.
+	void Invalidate(ELStage stage);
+
+	// Runs the changed stages again for the current strike, reusing the results of the stages before them.
+	void Regenerate();
+
+	// The earliest stage that needs to run again, or LStage_Count if nothing has changed.
+	ELStage DirtyStage;
+
+	// Whether the current strike was generated by the L system, so its stages can be run again.
+	bool bHasLSystemStrike;
+
+	// Returns the turtle settings for the current L-system properties.
+	LTurtleSettings GetTurtleSettings() const;
+
+	// Spawns the particle system for a segment drawn by the turtle.
+	void DrawSegment(const LSegmentBuffer& segments, int32 index);
 	
 	// Rebuilds the rules used in the L-system.
 	void RebuildRules();
@@ -194,7 +343,31 @@ protected:
 	float ImGuiScale;
 	float RenderTime;
 	float GenerationTime;
+
+	// Time from spawning a strike to drawing its first segment, and when the current strike was spawned.
+	float TimeToFirstSegment;
+	double SpawnTime;
+	bool bAwaitingFirstSegment;
+
+	// Records the time to first segment if it is the strike's first.
+	void MarkSegmentDrawn();
 	
+	// Seeds for the random numbers used in generating lightning.
+	// *** //
+	// The generator's seed. Each strike's seed is made from this, or is this when using a fixed seed.
+	UPROPERTY(BlueprintReadWrite)
+	int32 Seed;
+
+	// When enabled, every strike uses the generator's seed, so the same lightning is generated each time.
+	UPROPERTY(BlueprintReadWrite)
+	bool bUseFixedSeed;
+
+	// The seed of the last strike, and the number of strikes so far.
+	int32 StrikeSeed;
+	int32 StrikeCount;
+
+	// *** //
+
 	// Whether lightning is automatically generated using the timer.
 	UPROPERTY(BlueprintReadWrite)
 	bool bAutoGenerate;
@@ -211,6 +384,19 @@ protected:
 	float Spawn100Times;
 	float Render100Times;
 
+	// Rewrites the L-system with 1 to N cores, storing the throughput of each in millions of symbols per second.
+	void BenchmarkRewriting();
+	TArray<float> RewriteThroughput;
+
+	// Times the random numbers needed for a 10 iteration L-system and a 500 segment physics bolt, using one call per number and using random blocks.
+	void BenchmarkRandom();
+	float GrammarRandomTimes[2];
+	float PhysicsRandomTimes[2];
+
+	// Interprets the current L-system symbols with a separate turtle on 1 core and on every core, storing the throughput of each in millions of symbols per second.
+	void BenchmarkTurtle();
+	float TurtleThroughput[2];
+
 	void Render();
 	
 public:	
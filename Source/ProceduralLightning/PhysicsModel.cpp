@@ -23,7 +23,8 @@ PhysicsModel::PhysicsModel()
 	MaxSegments = 500;
 	bUseSegmentLimit = true;
 	bPackagedBuildFix = true;
-	Rand_Generator.seed(time(NULL));
+	bIs3DEnabled = true;
+	Rand_Generator.Seed(FPlatformTime::Cycles64(), LRandomStream_Physics);
 	// *** //
 }
 
@@ -31,6 +32,17 @@ PhysicsModel::~PhysicsModel()
 {
 }
 
+// Released segments are published in bolts that outlive generation and are read on other threads, so they can't keep pointers into it.
+TArray<Segment> PhysicsModel::ReleaseSegments()
+{
+	for (Segment& segment : LightningSegments)
+	{
+		segment.Parent = nullptr;
+	}
+
+	return MoveTemp(LightningSegments);
+}
+
 // Procedurally generate lightning segments.
 void PhysicsModel::GenerateSegments()
 {
@@ -53,13 +65,8 @@ void PhysicsModel::GenerateSegments()
 		tempRange.X = SeaLevelTemp;
 		tempRange.Y = startAltitudeTemp;
 
-		// Normal distributions for the length of segments, angle of branching, and the constant A.
-		std::normal_distribution<float> lenDistribution(Length, LengthDeviation);
-		std::normal_distribution<float> angleDistribution(Angle, AngleDeviation);
-		std::normal_distribution<float> constDistribution(ConstantA, ConstantADeviation);
-
-		// Calculate A.
-		float constA = constDistribution(Rand_Generator);
+		// Calculate A from its normal distribution. The length of segments and angle of branching are also normally distributed, and are taken from the generator's gaussian block as they are needed.
+		float constA = Rand_Generator.Gaussian(ConstantA, ConstantADeviation);
 
 		// Don't allow the constant to drop too low.
 		if (constA < 0.01)
@@ -90,7 +97,7 @@ void PhysicsModel::GenerateSegments()
 				if (firstSegment) // The very first segment is generated slightly differently.
 				{
 					firstSegment = false;
-					GenerateFirstSegment(segment, constA, lenDistribution); // generate the segment
+					GenerateFirstSegment(segment, constA); // generate the segment
 					currentBranch.Add(segment); // add segment to branch.
 					secondSegment = true; // next segment will be the second segment.
 				}
@@ -145,20 +152,20 @@ void PhysicsModel::GenerateSegments()
 						float splitAngle;
 						float splitAngleOffset;
 
-						//CalculateAngles(angleDistribution, branchAngle, splitAngle, splitAngleOffset, rotation);
-						branchAngle = CalculateAngle(angleDistribution);
+						//CalculateAngles(branchAngle, splitAngle, splitAngleOffset, rotation);
+						branchAngle = CalculateAngle();
 
 						// The angle is split between this segment, and the other segment in the branch.
 						splitAngle = branchAngle / 2;
 
 						// Calculate the offset to add to the branching angle, so that the split is not always in the middle.
-						splitAngleOffset = FMath::FRandRange(-branchAngle / 2, branchAngle / 2);
+						splitAngleOffset = Rand_Generator.FRandRange(-branchAngle / 2, branchAngle / 2);
 
-						if (FMath::RandBool()) { splitAngle = -splitAngle; }; // 50% chance to flip the angle.
+						if (Rand_Generator.RandBool()) { splitAngle = -splitAngle; }; // 50% chance to flip the angle.
 
 						// Create rotator from angles and offsets.
 
-						if (*bIs3DEnabled) // 3D - apply to X and Y dimensions. 2D - just X dimension.
+						if (bIs3DEnabled) // 3D - apply to X and Y dimensions. 2D - just X dimension.
 						{
 							rotation = FRotator(splitAngle + splitAngleOffset, splitAngle + splitAngleOffset, 0);
 						}
@@ -189,7 +196,7 @@ void PhysicsModel::GenerateSegments()
 						// Apply diameter, calculate length and set end position.
 						segment.Diameter = diameter;
 						
-						segment.Length = CalculateLength(lenDistribution, segment);
+						segment.Length = CalculateLength(segment);
 						
 						segment.EndPos = segment.StartPos + (segment.Direction * segment.Length);
 						// *** //
@@ -229,7 +236,7 @@ void PhysicsModel::GenerateSegments()
 }
 
 // Calculate the pressure at a specified height based on the general barometric formula. The exact equation used is provided here: https://www.engineeringtoolbox.com/air-altitude-pressure-d_462.html
-float PhysicsModel::CalculatePressure(float height)
+float PhysicsModel::CalculatePressure(float height) const
 {
 	SCOPE_CYCLE_COUNTER(STAT_Pressure) 
 	{
@@ -238,7 +245,7 @@ float PhysicsModel::CalculatePressure(float height)
 }
 
 // Generate the first lightning segment.
-void PhysicsModel::GenerateFirstSegment(Segment& segment, float A, std::normal_distribution<float> lenDistribution)
+void PhysicsModel::GenerateFirstSegment(Segment& segment, float A)
 {
 	SCOPE_CYCLE_COUNTER(STAT_FirstSeg)
 	{
@@ -258,12 +265,12 @@ void PhysicsModel::GenerateFirstSegment(Segment& segment, float A, std::normal_d
 		
 
 		// No equation for the initial direction of the lightning, so just create direction from a random angle in a specified range.
-		float randomAngle = FMath::RandRange(-InitialAngleRange, InitialAngleRange);
+		float randomAngle = Rand_Generator.FRandRange(-InitialAngleRange, InitialAngleRange);
 
 		FRotator startRotation;
 
 		// Apply angle in X and Y dimensions for 3D, only in X for 2D.
-		if (*bIs3DEnabled)
+		if (bIs3DEnabled)
 		{
 			startRotation = FRotator(randomAngle, randomAngle, 0);
 		}
@@ -282,7 +289,7 @@ void PhysicsModel::GenerateFirstSegment(Segment& segment, float A, std::normal_d
 
 		// The length is calculated using the equation: L / d = Ld. Ld is the normally distributed length which can be adjusted by the user. In the original equation, this is 11+/-4. The final equation thus becomes L = Ld * d. Scaling is applied to the result.
 	
-		segment.Length = CalculateLength(lenDistribution, segment);
+		segment.Length = CalculateLength(segment);
 		
 
 		// The end position of the segment is provided by adding the segment direction multiplied by the length on to the start position's vector.
@@ -322,32 +329,32 @@ float PhysicsModel::CalculateInitDiameter()
 	}
 }
 
-float PhysicsModel::CalculateLength(std::normal_distribution<float> lenDistribution, Segment& segment)
+float PhysicsModel::CalculateLength(Segment& segment)
 {
 	SCOPE_CYCLE_COUNTER(STAT_Length)
 	{
-		return lenDistribution(Rand_Generator) * segment.Diameter * Scale;
+		return Rand_Generator.Gaussian(Length, LengthDeviation) * segment.Diameter * Scale;
 	}
 }
 
-void PhysicsModel::CalculateAngles(std::normal_distribution<float> angleDistribution, float& branchAngle, float& splitAngle, float& splitAngleOffset, FRotator& rotation)
+void PhysicsModel::CalculateAngles(float& branchAngle, float& splitAngle, float& splitAngleOffset, FRotator& rotation)
 {
 	// Get branching angle from normal distribution.
 	SCOPE_CYCLE_COUNTER(STAT_Angle)
 	{
-		branchAngle = angleDistribution(Rand_Generator);
+		branchAngle = Rand_Generator.Gaussian(Angle, AngleDeviation);
 
 		// The angle is split between this segment, and the other segment in the branch.
 		splitAngle = branchAngle / 2;
 
 		// Calculate the offset to add to the branching angle, so that the split is not always in the middle.
-		splitAngleOffset = FMath::FRandRange(-branchAngle / 2, branchAngle / 2);
+		splitAngleOffset = Rand_Generator.FRandRange(-branchAngle / 2, branchAngle / 2);
 
-		if (FMath::RandBool()) { splitAngle = -splitAngle; }; // 50% chance to flip the angle.
+		if (Rand_Generator.RandBool()) { splitAngle = -splitAngle; }; // 50% chance to flip the angle.
 
 		// Create rotator from angles and offsets.
 
-		if (*bIs3DEnabled) // 3D - apply to X and Y dimensions. 2D - just X dimension.
+		if (bIs3DEnabled) // 3D - apply to X and Y dimensions. 2D - just X dimension.
 		{
 			rotation = FRotator(splitAngle + splitAngleOffset, splitAngle + splitAngleOffset, 0);
 		}
@@ -358,11 +365,11 @@ void PhysicsModel::CalculateAngles(std::normal_distribution<float> angleDistribu
 	}
 }
 
-float PhysicsModel::CalculateAngle(std::normal_distribution<float> angleDistribution)
+float PhysicsModel::CalculateAngle()
 {
 	SCOPE_CYCLE_COUNTER(STAT_Angle)
 	{
-		return angleDistribution(Rand_Generator);
+		return Rand_Generator.Gaussian(Angle, AngleDeviation);
 	}
 }
 
@@ -374,13 +381,13 @@ void PhysicsModel::BranchLogic(Segment& segment, TArray<Segment>& branchPoints,
 		if (diameter > segment.MinDiameter)
 		{
 			// Not physically based - branch chance to give a bit more variety in results instead of branching every single time.
-			if (FMath::FRandRange(0.f, 1.f) < BranchChance)
+			if (Rand_Generator.FRandRange(0.f, 1.f) < BranchChance)
 			{
 				// Save this segment as a branching point.
 				branchPoints.Add(segment);
 
 				// Negate split angle so the new branch goes in the opposite direction.
-				if (*bIs3DEnabled)
+				if (bIs3DEnabled)
 				{
 					rotation = FRotator(-splitAngle + splitAngleOffset, splitAngle + splitAngleOffset, 0);
 				}
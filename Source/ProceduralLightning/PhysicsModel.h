@@ -5,7 +5,7 @@
 #pragma once
 
 #include "CoreMinimal.h"
-#include <random>
+#include "LRandom.h"
 
 DECLARE_STATS_GROUP(TEXT("PModel"), STATGROUP_PModel, STATCAT_Advanced);
 DECLARE_CYCLE_STAT(TEXT("CalculatePressure"), STAT_Pressure, STATGROUP_PModel);
@@ -22,6 +22,7 @@ DECLARE_CYCLE_STAT(TEXT("GenerateFirstSegment"), STAT_FirstSeg, STATGROUP_PModel
 // A struct for segments of lightning, containing all parameters necessary for the equations and rendering.
 struct Segment
 {
+	// The segment this one continues or branches from. It points into arrays local to GenerateSegments, so it is only valid while generating.
 	Segment* Parent;
 	FVector StartPos;
 	FVector EndPos;
@@ -49,13 +50,19 @@ public:
 	void GenerateSegments();
 
 	// Returns generated lightning segments.
-	TArray<Segment> GetSegments() { return LightningSegments; };
+	const TArray<Segment>& GetSegments() const { return LightningSegments; };
 
-	// Set pointer to the generator's 3D mode bool.
-	void Set3DMode(bool* b) { bIs3DEnabled = b; };
+	// Moves the generated segments out of the model. Each segment's parent is cleared, as it would point into memory freed when generation finished.
+	TArray<Segment> ReleaseSegments();
+
+	// Set the seed for the random number generator. The same seed and properties always generate the same lightning.
+	void SetSeed(int32 seed) { Rand_Generator.Seed((uint32)seed, LRandomStream_Physics); };
+
+	// Set whether lightning is 3D. This is stored by value, so a copy of the model can generate on another thread.
+	void Set3DMode(bool b) { bIs3DEnabled = b; };
 
 	// Calculates pressure based on the general barometric formula.
-	float CalculatePressure(float height);
+	float CalculatePressure(float height) const;
 
 	// A multiplier used for simulating increased or decreased pressure.
 	float PressureMultiplier;
@@ -105,14 +112,14 @@ private:
 	// Array of the generated segments.
 	TArray<Segment> LightningSegments;
 
-	// Random number generator for normal distribution.
-	std::default_random_engine Rand_Generator;
+	// Random number generator. Numbers are generated in blocks and taken from them one at a time, for both the normal distributions and other random choices.
+	LRandomBlock Rand_Generator;
 
-	// Pointer to a bool for whether 3D lightning should be enabled.
-	bool* bIs3DEnabled;
+	// Whether 3D lightning should be enabled.
+	bool bIs3DEnabled;
 
 	// The first segment is unique so it has its own function for generation.
-	void GenerateFirstSegment(Segment& segment, float A, std::normal_distribution<float> lenDistribution);
+	void GenerateFirstSegment(Segment& segment, float A);
 
 	float CalculateTemp(Segment& segment);
 
@@ -122,11 +129,11 @@ private:
 
 	float CalculateInitDiameter();
 
-	float CalculateLength(std::normal_distribution<float> lenDistribution, Segment& segment);
+	float CalculateLength(Segment& segment);
 
-	void CalculateAngles(std::normal_distribution<float> angleDistribution, float& branchAngle, float& splitAngle, float& splitAngleOffset, FRotator& rotation);
+	void CalculateAngles(float& branchAngle, float& splitAngle, float& splitAngleOffset, FRotator& rotation);
 
-	float CalculateAngle(std::normal_distribution<float> angleDistribution);
+	float CalculateAngle();
 
 	void BranchLogic(Segment& segment, TArray<Segment>& branchPoints, FRotator& rotation, float& splitAngle, float& splitAngleOffset, TArray<FVector>& branchDirection, bool& secondSegment, bool& bIsBranchFinished, float& diameter);
 };